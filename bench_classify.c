@@ -0,0 +1,198 @@
+// Tokenizer microbenchmark for msh.
+//
+// Times the character classifiers `tokenize' picks between (scalar,
+// SSE2 and AVX2) on generated command lines of several lengths, then the
+// whole of `tokenize' against the strspn/strcspn tokenizer it replaced,
+// which scanned each word again for `GLOB_CHARS' afterwards.  Both
+// tokenizers are checked to split every line the same way first.
+//
+// Build and run it next to msh.c, whose functions it uses:
+//     gcc -O2 bench_classify.c -o bench_classify -pthread
+//     ./bench_classify [MB]
+//
+// MB (64 by default) is how much of each line length is processed.
+
+#define main msh_main
+#include "msh.c"
+#undef main
+
+// The tokenizer from before the classifiers, with the glob scan that
+// `check_glob' did over each word
+static char **tokenize_strspn(struct arena *arena, char *s,
+                              const char *separators,
+                              const char *special_chars, bool **needs_glob) {
+    size_t n_tokens = 0;
+    size_t s_length = strlen(s);
+    char *bytes = arena_alloc(arena, 2 * s_length + 1);
+    char *end = bytes;
+    while (*s != '\0') {
+        s += strspn(s, separators);
+        if (*s == '\0') {
+            break;
+        }
+        size_t length = strcspn(s, separators);
+        size_t length_without_specials = strcspn(s, special_chars);
+        if (length_without_specials == 0) {
+            length_without_specials = 1;
+        }
+        if (length_without_specials < length) {
+            length = length_without_specials;
+        }
+        memcpy(end, s, length);
+        end[length] = '\0';
+        end += length + 1;
+        s += length;
+        n_tokens++;
+    }
+    arena_shrink(arena, bytes, end - bytes);
+
+    char **tokens = arena_alloc(arena, (n_tokens + 1) * sizeof *tokens);
+    *needs_glob = arena_alloc(arena, (n_tokens + 1) * sizeof **needs_glob);
+    char *token = bytes;
+    for (size_t i = 0; i < n_tokens; i++) {
+        tokens[i] = token;
+        (*needs_glob)[i] = false;
+        for (char *c = token; *c != '\0'; c++) {
+            if (strchr(GLOB_CHARS, *c) != NULL) {
+                (*needs_glob)[i] = true;
+                break;
+            }
+        }
+        token += strlen(token) + 1;
+    }
+    tokens[n_tokens] = NULL;
+    return tokens;
+}
+
+// Returns a command line of about length bytes, malloc'd, made of the
+// kinds of words a generated command line has
+static char *make_line(size_t length) {
+    static const char *const words[] = {
+        "-v", "--output=report.txt", "src/module_%04d.c", "include/*.h",
+        "|", "data/file_%04d.json", ">", "out_%04d.log", "\t",
+        "build/obj/[a-f]*.o", "'quoted'", "&", "~/notes_%04d.md",
+    };
+    char *line = malloc(length + 64);
+    assert(line != NULL);
+    size_t used = 0;
+    for (int i = 0; used < length; i++) {
+        const char *word = words[i % (sizeof words / sizeof *words)];
+        used += snprintf(line + used, length + 64 - used, "%s ", word);
+        used += snprintf(line + used, length + 64 - used, word, i);
+        line[used++] = ' ';
+    }
+    line[length] = '\0';
+    return line;
+}
+
+int main(int argc, char **argv) {
+    long mb = argc > 1 ? atol(argv[1]) : 64;
+    if (mb < 1) {
+        fprintf(stderr, "usage: bench_classify [MB]\n");
+        return 2;
+    }
+    static const size_t lengths[] = {64, 1024, 16 * 1024, 256 * 1024};
+    enum { N_LENGTHS = sizeof lengths / sizeof *lengths };
+
+    __builtin_cpu_init();
+    const struct {
+        const char *name;
+        classify_fn *classify;
+        bool supported;
+    } classifiers[] = {
+        {"scalar", classify_scalar, true},
+#ifdef MSH_X86_SIMD
+        {"sse2", classify_sse2, __builtin_cpu_supports("sse2")},
+        {"avx2", classify_avx2, __builtin_cpu_supports("avx2")},
+#endif
+    };
+
+    char *lines[N_LENGTHS];
+    for (int l = 0; l < N_LENGTHS; l++) {
+        lines[l] = make_line(lengths[l]);
+    }
+
+    printf("classifiers, GB/s by line length\n%-20s", "");
+    for (int l = 0; l < N_LENGTHS; l++) {
+        printf(" %9zu", lengths[l]);
+    }
+    printf("\n");
+    for (size_t c = 0; c < sizeof classifiers / sizeof *classifiers; c++) {
+        if (!classifiers[c].supported) {
+            printf("%-20s (not supported by this CPU)\n", classifiers[c].name);
+            continue;
+        }
+        printf("%-20s", classifiers[c].name);
+        for (int l = 0; l < N_LENGTHS; l++) {
+            size_t length = lengths[l];
+            size_t n_words = length / 64 + 1;
+            uint64_t *bits = malloc(3 * n_words * sizeof *bits);
+            assert(bits != NULL);
+            long rounds = mb * 1024 * 1024 / length;
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (long r = 0; r < rounds; r++) {
+                memset(bits, 0, 3 * n_words * sizeof *bits);
+                classifiers[c].classify(lines[l], length, WORD_SEPARATORS,
+                                        SPECIAL_CHARS, bits, bits + n_words,
+                                        bits + 2 * n_words);
+                // keep the results from being optimised away
+                __asm__ volatile("" : : "r"(bits) : "memory");
+            }
+            printf(" %9.2f", (double)rounds * length / elapsed_ns(&start));
+            free(bits);
+        }
+        printf("\n");
+    }
+
+    printf("\ntokenizers, ns per line by line length\n%-20s", "");
+    for (int l = 0; l < N_LENGTHS; l++) {
+        printf(" %9zu", lengths[l]);
+    }
+    printf("\n");
+    struct arena arena = {0};
+    for (int t = 0; t < 2; t++) {
+        printf("%-20s", t == 0 ? "strspn (before)" : "tokenize");
+        for (int l = 0; l < N_LENGTHS; l++) {
+            size_t length = lengths[l];
+            if (t == 0) {
+                // both must split the line the same way
+                bool *glob_a, *glob_b;
+                char **a = tokenize_strspn(&arena, lines[l], WORD_SEPARATORS,
+                                           SPECIAL_CHARS, &glob_a);
+                char **b = tokenize(&arena, lines[l], (char *)WORD_SEPARATORS,
+                                    (char *)SPECIAL_CHARS, &glob_b);
+                for (int i = 0; a[i] != NULL || b[i] != NULL; i++) {
+                    if (a[i] == NULL || b[i] == NULL ||
+                        strcmp(a[i], b[i]) != 0 || glob_a[i] != glob_b[i]) {
+                        fprintf(stderr, "\ntokenizers differ at word %d\n",
+                                i);
+                        return 1;
+                    }
+                }
+                arena_reset(&arena);
+            }
+            long rounds = mb * 1024 * 1024 / length;
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (long r = 0; r < rounds; r++) {
+                bool *needs_glob;
+                char **words =
+                    t == 0 ? tokenize_strspn(&arena, lines[l], WORD_SEPARATORS,
+                                             SPECIAL_CHARS, &needs_glob)
+                           : tokenize(&arena, lines[l],
+                                      (char *)WORD_SEPARATORS,
+                                      (char *)SPECIAL_CHARS, &needs_glob);
+                __asm__ volatile("" : : "r"(words) : "memory");
+                arena_reset(&arena);
+            }
+            printf(" %9.0f", (double)elapsed_ns(&start) / rounds);
+        }
+        printf("\n");
+    }
+
+    for (int l = 0; l < N_LENGTHS; l++) {
+        free(lines[l]);
+    }
+    return 0;
+}
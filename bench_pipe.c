@@ -0,0 +1,111 @@
+// Pipeline throughput benchmark for msh.
+//
+// Runs pipelines through msh itself, copying a file of MB megabytes of
+// text from a producer to a consumer, once for each `pipesize', and
+// prints how many MB/s went through.  The pairs cover programs and msh's
+// own utilities (which run on threads) at either end of the pipe.
+//
+// Build and run it next to msh.c, whose functions it uses:
+//     gcc -O2 bench_pipe.c -o bench_pipe -pthread
+//     ./bench_pipe [MB [RUNS]]
+//
+// Each figure is the best of RUNS (3 by default).
+
+#define main msh_main
+#include "msh.c"
+#undef main
+
+int main(int argc, char **argv) {
+    long mb = argc > 1 ? atol(argv[1]) : 256;
+    long runs = argc > 2 ? atol(argv[2]) : 3;
+    if (mb < 1 || runs < 1) {
+        fprintf(stderr, "usage: bench_pipe [MB [RUNS]]\n");
+        return 2;
+    }
+    extern char **environ;
+    setenv("MSH_HISTORY", "off", 1);
+    options_init();
+    events_init();
+
+    // lines of text, so the line counting consumers have work to do
+    char file[] = "/tmp/bench_pipe.XXXXXX";
+    int fd = mkstemp(file);
+    assert(fd != -1);
+    char line[64];
+    struct buffer text = {0};
+    for (long i = 0; text.length < 1024 * 1024; i++) {
+        int length = snprintf(line, sizeof line, "%08ld the quick brown fox "
+                                                 "jumps over the lazy dog\n",
+                              i);
+        buffer_add(&text, line, length);
+    }
+    for (long i = 0; i < mb; i++) {
+        bool written = write_all(fd, text.data, 1024 * 1024);
+        assert(written);
+    }
+    close(fd);
+    free(text.data);
+
+    static const struct {
+        const char *name;
+        const char *line;
+    } pairs[] = {
+        {"program | program", "command cat %s | command wc -l"},
+        {"program | utility", "command cat %s | wc -l"},
+        {"utility | program", "cat %s | command wc -l"},
+        {"utility | utility", "cat %s | wc -l"},
+    };
+    static const char *const sizes[] = {
+        "0", "128k", "256k", "512k", "1m", "auto",
+    };
+    enum { N_SIZES = sizeof sizes / sizeof *sizes };
+
+    printf("%ld MB, MB/s by pipesize (0 is the kernel's 64 KiB)\n", mb);
+    printf("%-18s", "pair");
+    for (int s = 0; s < N_SIZES; s++) {
+        printf(" %7s", sizes[s]);
+    }
+    printf("\n");
+
+    // msh's own output goes nowhere while the pipelines run
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    for (size_t p = 0; p < sizeof pairs / sizeof *pairs; p++) {
+        double rates[N_SIZES];
+        for (int s = 0; s < N_SIZES; s++) {
+            char pipeline[256];
+            snprintf(pipeline, sizeof pipeline, pairs[p].line, file);
+            char command[512];
+            snprintf(command, sizeof command,
+                     "pipesize=%s filters=on %s > /dev/null", sizes[s],
+                     pipeline);
+            long best = LONG_MAX;
+            for (long r = 0; r < runs; r++) {
+                fflush(stdout);
+                dup2(null, STDOUT_FILENO);
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                // execute_line tokenizes the line where it lies
+                char *copy = strdup(command);
+                execute_line(copy, environ);
+                free(copy);
+                long ns = elapsed_ns(&start);
+                fflush(stdout);
+                dup2(saved_stdout, STDOUT_FILENO);
+                if (ns < best) {
+                    best = ns;
+                }
+            }
+            rates[s] = mb / (best / 1e9);
+        }
+        printf("%-18s", pairs[p].name);
+        for (int s = 0; s < N_SIZES; s++) {
+            printf(" %7.0f", rates[s]);
+        }
+        printf("\n");
+    }
+    close(null);
+    close(saved_stdout);
+    unlink(file);
+    return 0;
+}
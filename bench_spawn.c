@@ -0,0 +1,107 @@
+// Spawn latency benchmark for msh.
+//
+// Times starting a short program and waiting for it to exit, the way msh
+// runs every command, with each of the ways msh can start one: clone(2)
+// (`fastspawn'), posix_spawn, and the zygote, with plain fork and exec
+// for comparison.  A heap of HEAP_MB megabytes, every page touched, stands
+// in for a shell that has grown large.
+//
+// Build and run it next to msh.c, whose functions it uses:
+//     gcc -O2 bench_spawn.c -o bench_spawn -pthread
+//     ./bench_spawn [RUNS [HEAP_MB [PROGRAM]]]
+//
+// Examples:
+//     % ./bench_spawn 2000 0
+//     % ./bench_spawn 2000 2048 /bin/true
+
+#define main msh_main
+#include "msh.c"
+#undef main
+
+// Starts path with fork and execve, and waits for it
+static void fork_exec(char *path, char **arguments, char **environment) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execve(path, arguments, environment);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Starts path as msh would, and waits for it through the job table
+static void msh_spawn(char *path, char **arguments, char **environment) {
+    struct job *job = job_new(arguments, false);
+    struct spawn_actions actions = {.count = 0};
+    pid_t pid;
+    int pidfd;
+    int err = spawn(&pid, &pidfd, path, &actions, arguments, environment);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(err));
+        exit(1);
+    }
+    job_add(job, pid, pidfd, NULL);
+    job_finish(job);
+}
+
+int main(int argc, char **argv) {
+    long runs = argc > 1 ? atol(argv[1]) : 1000;
+    long heap_mb = argc > 2 ? atol(argv[2]) : 0;
+    char *path = argc > 3 ? argv[3] : "/bin/true";
+    if (runs < 1 || heap_mb < 0) {
+        fprintf(stderr, "usage: bench_spawn [RUNS [HEAP_MB [PROGRAM]]]\n");
+        return 2;
+    }
+    extern char **environ;
+    char *arguments[] = {path, NULL};
+
+    options_init();
+    events_init();
+    // the zygote is forked while msh is still small, as msh does
+    options[OPTION_ZYGOTE].value = 1;
+    zygote_start();
+
+    char *heap = malloc(heap_mb * 1024 * 1024 + 1);
+    assert(heap != NULL);
+    memset(heap, 1, heap_mb * 1024 * 1024 + 1);
+
+    static const struct {
+        const char *name;
+        long zygote;
+        long fastspawn;
+        bool fork;
+    } modes[] = {
+        {"fork+exec", 0, 0, true},
+        {"posix_spawn", 0, 0, false},
+        {"clone (fastspawn)", 0, 1, false},
+        {"zygote", 1, 0, false},
+    };
+    // the methods take turns, a block of runs at a time, so a machine
+    // that gets busier or quieter part way through favours none of them
+    enum { N_MODES = sizeof modes / sizeof *modes, BLOCK = 50 };
+    long total_ns[N_MODES] = {0};
+    for (long done = 0; done < runs; done += BLOCK) {
+        for (int m = 0; m < N_MODES; m++) {
+            options[OPTION_ZYGOTE].value = modes[m].zygote;
+            options[OPTION_FASTSPAWN].value = modes[m].fastspawn;
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (long i = done; i < runs && i < done + BLOCK; i++) {
+                if (modes[m].fork) {
+                    fork_exec(path, arguments, environ);
+                } else {
+                    msh_spawn(path, arguments, environ);
+                }
+            }
+            total_ns[m] += elapsed_ns(&start);
+        }
+    }
+
+    printf("%ld runs of %s, heap %ld MB\n", runs, path, heap_mb);
+    printf("%-20s %12s %12s\n", "method", "us/spawn", "spawns/s");
+    for (int m = 0; m < N_MODES; m++) {
+        double us = total_ns[m] / 1000.0 / runs;
+        printf("%-20s %12.1f %12.0f\n", modes[m].name, us, 1000000 / us);
+    }
+    free(heap);
+    return 0;
+}
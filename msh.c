@@ -1,20 +1,46 @@
 // Updated on 07/09/2022
 // msh, my shell written in C.
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sched.h>
 #include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MSH_X86_SIMD 1
+#endif
+
 //
 // Interactive prompt:
 //     The default prompt displayed in `interactive' mode --- when both
@@ -38,16 +64,20 @@ static const char *const DEFAULT_PATH = "/bin:/usr/bin";
 static const int DEFAULT_HISTORY_SHOWN __attribute__(()) = 10;
 
 //
-// Input line length:
-//     The length of the longest line of input we can read.
+// Input buffer size:
+//     The initial size of the buffer input lines are read into.  The
+//     buffer doubles whenever a line doesn't fit, so lines can be any
+//     length.
 //
-static const size_t MAX_LINE_CHARS = 1024;
+static const size_t INPUT_BUFFER_SIZE = 4096;
 
 //
 // Special characters:
 //     Characters that `tokenize' will return as words by themselves.
+//     `!' is one too, but only at the start of a line, where it recalls
+//     history; anywhere else `test a != b' needs it kept in its word.
 //
-static const char *const SPECIAL_CHARS = "!><|";
+static const char *const SPECIAL_CHARS = "><|&";
 
 //
 // Word separators:
@@ -55,39 +85,1171 @@ static const char *const SPECIAL_CHARS = "!><|";
 //
 static const char *const WORD_SEPARATORS = " \t\r\n";
 
-static void execute_command(char **words, char **path, char **environment);
+//
+// Glob characters:
+//     Characters that make `tokenize' mark a word as needing filename
+//     expansion.
+//
+static const char *const GLOB_CHARS = "*?[~";
+
+//
+// Character classifier:
+//     Sets bit `i' of `separator', `special' and `glob' when `s[i]' is
+//     one of `separators', `special_chars' or `GLOB_CHARS', for every
+//     `i' below `length'.  Each bitmap has room for `length' bits,
+//     rounded up to whole words, and starts zeroed.  The best version
+//     for this CPU is picked the first time `tokenize' runs.
+//
+typedef void classify_fn(const char *s, size_t length, const char *separators,
+                         const char *special_chars, uint64_t *separator,
+                         uint64_t *special, uint64_t *glob);
+
+//
+// Command hash buckets:
+//     The number of chains in the table that caches `$PATH' lookups.
+//
+#define COMMAND_HASH_BUCKETS 256
+
+//
+// Glob cache buckets:
+//     The number of chains in the table of directory listings.
+//
+#define GLOB_CACHE_BUCKETS 128
+
+//
+// Glob cache size:
+//     The most directory listings kept at once.  Reading one more than
+//     this throws all of them away.
+//
+static const int GLOB_CACHE_MAX_DIRS = 1024;
+
+//
+// Directory read size:
+//     How many bytes of directory entries are read per getdents64(2).
+//
+#define GETDENTS_BUFFER_SIZE (32 * 1024)
+
+//
+// Glob walker threads:
+//     The most threads that read directories for a `**' pattern.
+//
+#define GLOB_WALK_MAX_THREADS 16
+
+//
+// Argument headroom:
+//     Bytes kept free below `sysconf(_SC_ARG_MAX)' when splitting a
+//     command into batches, as POSIX asks of xargs.
+//
+static const long ARG_HEADROOM = 2048;
+
+//
+// Event batch:
+//     The most events handled per epoll_wait(2).
+//
+#define EVENT_BATCH 64
+
+//
+// Spawn actions:
+//     The most file descriptor changes made for one new program: its
+//     standard input, output and error.
+//
+#define SPAWN_MAX_ACTIONS 3
+
+//
+// Spawn stack size:
+//     Bytes of stack a program gets on the fast spawn path before it
+//     execs.
+//
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+//
+// Zygote message size:
+//     The most bytes in one request to the zygote, and the size of its
+//     socket buffers.  A program whose arguments and environment don't
+//     fit is started by msh itself.
+//
+#define ZYGOTE_MESSAGE_SIZE (256 * 1024)
+
+//
+// Zygote statistics buckets:
+//     The number of chains in the table of per-program statistics.
+//
+#define ZYGOTE_STATS_BUCKETS 64
+
+//
+// Cat buffer size:
+//     How many bytes the `cat' and `tee' builtins copy at a time.
+//
+#define CAT_BUFFER_SIZE (128 * 1024)
+
+//
+// Shard block size:
+//     About how much of its input `shard' gives a copy of its program at
+//     once; a block always ends at a newline, unless it is the last.
+//
+#define SHARD_BLOCK_SIZE (1024 * 1024)
+
+//
+// Shard max jobs:
+//     The most copies `shard -j' can run at once.
+//
+#define SHARD_MAX_JOBS 1024
+
+//
+// Batch jobs:
+//     The most command lines `msh -j' runs at once.
+//
+#define BATCH_MAX_JOBS 1024
+
+//
+// Batch read size:
+//     Bytes read at a time from each command's output in batch mode.
+//
+#define BATCH_READ_SIZE (64 * 1024)
+
+//
+// Filter buffer size:
+//     How many bytes the `wc', `head', `tail' and `grep' builtins read
+//     at a time.  Big reads mean fewer trips through the pipe.
+//
+#define FILTER_BUFFER_SIZE (1024 * 1024)
+
+//
+// Pipe auto sizes:
+//     With `pipesize' set to auto, each pipe is sized for the stage that
+//     reads it, so one read can take everything a busy writer has put in:
+//     `FILTER_BUFFER_SIZE' for msh's own utilities, which read that much
+//     at a time, and `PIPE_PROGRAM_SIZE' for programs, twice the 128 KiB
+//     that coreutils read and write at a time.  No pipe gets more than
+//     /proc/sys/fs/pipe-max-size, or than its share of
+//     1/`PIPE_BUDGET_SHARE' of the user's soft limit on pipe memory
+//     (/proc/sys/fs/pipe-user-pages-soft), past which the kernel gives new
+//     pipes a single page.
+//
+#define PIPE_PROGRAM_SIZE (256 * 1024)
+#define PIPE_BUDGET_SHARE 16
+
+//
+// Hash recheck interval:
+//     At most this often (in milliseconds) the directories in `$PATH'
+//     are stat'ed to see whether any cached lookup has gone stale.
+//     `hash -r' forgets everything immediately.
+//
+static const long HASH_RECHECK_MS = 1000;
+
+//
+// Admission recheck interval:
+//     How often (in milliseconds) the admission controller reads
+//     /proc/pressure and /proc/loadavg again.  The kernel only updates
+//     the pressure averages every two seconds, so reading them more often
+//     would just count the same reading twice.
+//
+static const long ADMIT_RECHECK_MS = 2000;
+
+//
+// Longest timeout:
+//     The most seconds `wait -t' accepts, and the most `sleep' sleeps,
+//     about 31 years.  Added to the monotonic clock it still fits in even
+//     a 32-bit `time_t'.
+//
+static const double TIMEOUT_MAX_SECONDS = 1e9;
+
+//
+// Shell options:
+//     Settings shown and changed by the `set' builtin.  Each one starts
+//     from `$MSH_<NAME>' (e.g. `$MSH_HISTSIZE') when that is set, and
+//     from the default given here otherwise.
+//
+//     history     read and write the history file; when off, commands
+//                 are only remembered for this session
+//     histsize    commands kept in memory for `history' and `!'; older
+//                 ones stay in the file but can't be recalled
+//     histflush   commands written to the history file at a time; 0
+//                 only writes them when the shell exits
+//     globcache   keep directory listings between commands, dropping
+//                 them when inotify says they changed; auto keeps them
+//                 only when the shell is interactive
+//     globsort    sort the pathnames a pattern matches; off leaves them
+//                 in the order they were found, which is faster for
+//                 large `**' expansions
+//     globthreads threads reading directories for `**'; auto uses one
+//                 per CPU
+//     argbatch    when a glob expands past the kernel's argument limit,
+//                 run the command several times, xargs-style, each with
+//                 as many of the matches as fit
+//     argjobs     how many of those batches run at once; auto uses one
+//                 per CPU
+//     fastspawn   start programs with clone(2) sharing msh's memory
+//                 until they exec, rather than with posix_spawn
+//     zygote      start programs from a helper process forked when msh
+//                 starts (set MSH_ZYGOTE=on for that), keeping
+//                 statistics for the `zygote' built-in
+//     filters     run `wc', `head', `tail' and fixed-string `grep' inside
+//                 msh, on a thread when they are part of a pipeline,
+//                 whenever msh handles all the options they are given
+//     pipesize    the buffer size of each pipe in a pipeline, up to
+//                 /proc/sys/fs/pipe-max-size; 0 keeps the kernel's
+//                 default, and auto sizes each pipe for the stage
+//                 reading it, see `PIPE_PROGRAM_SIZE'
+//     admit       start fewer of the commands msh runs side by side
+//                 while the machine is busy; see `admit'
+//     cpupressure the percentage of the last ten seconds some task was
+//                 waiting for a CPU (from /proc/pressure/cpu) above
+//                 which the machine is busy; 0 ignores it
+//     mempressure the same for memory, from /proc/pressure/memory
+//     iopressure  the same for I/O, from /proc/pressure/io
+//     loadlimit   the one-minute load average above which the machine
+//                 is busy; auto is twice the number of CPUs, and 0
+//                 ignores it
+//
+//     Any of them but `history' and `histsize', which shape a history
+//     that outlasts the command, can also be set for a single command by
+//     starting its line with NAME=VALUE words, e.g. `pipesize=1m cat big
+//     | wc -l'.  Only option names are taken that way; any other
+//     NAME=VALUE is the command's name.
+//
+enum option_kind {
+    OPTION_SWITCH, // on or off
+    OPTION_NUMBER, // a whole number, optionally ending in k, m or g
+};
+
+// The value of an option set to `auto', where `minimum' allows it
+#define OPTION_AUTO (-1L)
+
+enum option_id {
+    OPTION_HISTORY,
+    OPTION_HISTSIZE,
+    OPTION_HISTFLUSH,
+    OPTION_GLOBCACHE,
+    OPTION_GLOBSORT,
+    OPTION_GLOBTHREADS,
+    OPTION_ARGBATCH,
+    OPTION_ARGJOBS,
+    OPTION_FASTSPAWN,
+    OPTION_ZYGOTE,
+    OPTION_FILTERS,
+    OPTION_PIPESIZE,
+    OPTION_ADMIT,
+    OPTION_CPUPRESSURE,
+    OPTION_MEMPRESSURE,
+    OPTION_IOPRESSURE,
+    OPTION_LOADLIMIT,
+    N_OPTIONS,
+};
+
+struct option {
+    const char *name;
+    enum option_kind kind;
+    long value;
+    long minimum; // OPTION_AUTO if `auto' is allowed
+    long maximum;
+    const char *description;
+};
+
+static struct option options[N_OPTIONS] = {
+    [OPTION_HISTORY] = {"history", OPTION_SWITCH, 1, 0, 1,
+                        "read and write the history file"},
+    [OPTION_HISTSIZE] = {"histsize", OPTION_NUMBER, 1000, 1, INT_MAX,
+                         "commands kept for `history' and `!'"},
+    [OPTION_HISTFLUSH] = {"histflush", OPTION_NUMBER, 1, 0, INT_MAX,
+                          "commands written to the history file at once"},
+    [OPTION_GLOBCACHE] = {"globcache", OPTION_SWITCH, OPTION_AUTO,
+                          OPTION_AUTO, 1,
+                          "keep directory listings between commands"},
+    [OPTION_GLOBSORT] = {"globsort", OPTION_SWITCH, 1, 0, 1,
+                         "sort the pathnames a pattern matches"},
+    [OPTION_GLOBTHREADS] = {"globthreads", OPTION_NUMBER, OPTION_AUTO,
+                            OPTION_AUTO, GLOB_WALK_MAX_THREADS,
+                            "threads reading directories for `**'"},
+    [OPTION_ARGBATCH] = {"argbatch", OPTION_SWITCH, 0, 0, 1,
+                         "split glob expansions that are too long to run"},
+    [OPTION_ARGJOBS] = {"argjobs", OPTION_NUMBER, 1, OPTION_AUTO, 1024,
+                        "batches of a split expansion run at once"},
+    [OPTION_FASTSPAWN] = {"fastspawn", OPTION_SWITCH, 1, 0, 1,
+                          "start programs with clone(2) instead of "
+                          "posix_spawn"},
+    [OPTION_ZYGOTE] = {"zygote", OPTION_SWITCH, 0, 0, 1,
+                       "start programs from a small helper process"},
+    [OPTION_FILTERS] = {"filters", OPTION_SWITCH, 0, 0, 1,
+                        "run wc, head, tail and grep -F inside msh"},
+    [OPTION_PIPESIZE] = {"pipesize", OPTION_NUMBER, 0, OPTION_AUTO, INT_MAX,
+                         "buffer size of the pipes in a pipeline"},
+    [OPTION_ADMIT] = {"admit", OPTION_SWITCH, 1, 0, 1,
+                      "run fewer commands at once on a busy machine"},
+    [OPTION_CPUPRESSURE] = {"cpupressure", OPTION_NUMBER, 50, 0, 100,
+                            "busy above this % of time waiting for a CPU"},
+    [OPTION_MEMPRESSURE] = {"mempressure", OPTION_NUMBER, 10, 0, 100,
+                            "busy above this % of time waiting for memory"},
+    [OPTION_IOPRESSURE] = {"iopressure", OPTION_NUMBER, 40, 0, 100,
+                           "busy above this % of time waiting for I/O"},
+    [OPTION_LOADLIMIT] = {"loadlimit", OPTION_NUMBER, OPTION_AUTO,
+                          OPTION_AUTO, INT_MAX,
+                          "busy above this one-minute load average"},
+};
+
+//
+// Option overrides:
+//     The options that `NAME=VALUE' words at the start of a line have
+//     set for that one command, with the values to put back once it has
+//     run.
+//
+static struct {
+    enum option_id id[N_OPTIONS];
+    long value[N_OPTIONS];
+    int count;
+} option_overrides;
+
+//
+// Arena block size:
+//     The smallest block an arena asks `malloc(3)' for.
+//
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+//
+// Arena:
+//     A list of blocks that allocations are bumped out of and released
+//     all at once by `arena_reset'.  The blocks themselves are kept, so
+//     once an arena has grown to fit a command line, parsing the next
+//     one doesn't call `malloc' at all.
+//
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *head;
+    struct arena_block *current;
+};
+
+//
+// Input buffer:
+//     Bytes read from standard input by `read_line'.  `data[start]' up
+//     to `data[end]' haven't been returned as lines yet, and there is no
+//     newline before `data[scanned]' in that range.
+//
+static struct {
+    char *data;
+    size_t size;
+    size_t start;
+    size_t end;
+    size_t scanned;
+} input;
+
+//
+// Glob matches:
+//     The pathnames the current command's patterns expanded to.  The
+//     strings are in the command arena; the array is reused.
+//
+static struct {
+    char **paths;
+    size_t count;
+    size_t size;
+} glob_matches;
+
+//
+// Compiled glob patterns:
+//     `glob_compile' turns one pathname component of a pattern into a
+//     list of these operations for `glob_match'.
+//
+enum glob_op_type {
+    GLOB_OP_LITERAL, // the character `c'
+    GLOB_OP_ANY,     // `?': any one character
+    GLOB_OP_STAR,    // `*': any number of characters
+    GLOB_OP_CLASS,   // `[...]': any one character in `set'
+};
+
+struct glob_op {
+    enum glob_op_type type;
+    char c;
+    uint64_t set[4];
+};
+
+struct glob_compiled {
+    struct glob_op *ops;
+    size_t n_ops;
+    bool magic;           // has any wildcard at all
+    char *literal;        // the component unescaped, if not `magic'
+    size_t literal_length;
+    size_t min_length;    // the shortest name that can match
+    char *suffix;         // literal characters after the last `*', or NULL
+    size_t suffix_length;
+};
+
+//
+// Directory listings:
+//     The entries of every directory a pattern has been matched against,
+//     read once with getdents64(2).  `d_type' says which entries are
+//     directories without a stat(2) for each one.  Listings are kept for
+//     the rest of the command, and between commands while inotify can
+//     tell us when they go out of date (see the `globcache' option).
+//
+struct dir_entry {
+    uint32_t name;   // offset of the name in `names'
+    uint32_t length;
+    unsigned char type;
+};
+
+struct dir_listing {
+    char *path;      // absolute path of the directory
+    char *names;
+    struct dir_entry *entries;
+    size_t count;
+    int watch;       // inotify watch descriptor, or -1
+    struct dir_listing *next;
+};
+
+//
+// Recursive glob walk:
+//     The state shared by the threads expanding a `**' component.  Each
+//     worker has a queue of directories (paths relative to `root_fd')
+//     still to read.  It takes the newest from its own queue and, when
+//     that is empty, steals the oldest from another worker's.  `pending'
+//     counts the directories queued but not yet read.
+//
+struct glob_worker {
+    struct glob_walk *walk;
+    pthread_mutex_t lock;
+    char **queue;       // `queue[head]' to `queue[tail - 1]' are waiting
+    size_t head;
+    size_t tail;
+    size_t size;
+    char **found;       // pathnames this worker matched
+    size_t n_found;
+    size_t found_size;
+    struct arena arena; // holds the paths and pathnames
+    char buffer[GETDENTS_BUFFER_SIZE];
+};
+
+struct glob_walk {
+    char *dir;          // where the walk starts, as written in the pattern
+    int root_fd;
+    struct glob_compiled *compiled; // the component after `**', if one
+    char *suffix;       // slashes after that component
+    size_t suffix_length;
+    bool everything;    // `**' was the last component
+    bool want_dir;      // only match directories
+    bool collect_dirs;  // match the rest of the pattern afterwards
+    int n_workers;
+    atomic_long pending;
+    struct glob_worker workers[GLOB_WALK_MAX_THREADS];
+};
+
+static struct glob_walk glob_walker;
+
+static struct {
+    struct dir_listing *buckets[GLOB_CACHE_BUCKETS];
+    int n_listings;
+    char *cwd;        // current directory, fetched once per command
+    int inotify_fd;
+    bool interactive;
+} glob_cache = {.inotify_fd = -1};
+
+//
+// Command arena:
+//     Holds the words of the command line being executed, and anything
+//     derived from them.  Reset after every command.
+//
+static struct arena command_arena;
+
+//
+// Command hash table:
+//     Remembers where each command name was found in `$PATH', including
+//     names that were not found at all, so a command only has to be
+//     searched for once.  A directory whose mtime changes drops every
+//     negative entry and every entry found in it or after it.
+//
+struct hash_entry {
+    char *name;
+    char *pathname;  // NULL when `name' is not anywhere in `$PATH'
+    int dir;         // index in `path' of the directory `pathname' is in
+    unsigned long hits;
+    struct hash_entry *next;
+};
+
+static struct {
+    struct hash_entry *buckets[COMMAND_HASH_BUCKETS];
+    char *path_value;        // the `$PATH' value `path' was split from
+    char **path;             // NULL-terminated directories in `$PATH'
+    struct arena path_arena; // holds `path'
+    struct timespec *mtimes; // mtime of each directory in `path'
+    struct timespec checked; // when `mtimes' was last refreshed
+} command_hash;
+
+//
+// Command history:
+//     A ring of the most recent `capacity' command lines, loaded from
+//     the history file the first time it is needed.  History number `n'
+//     lives in `lines[n % capacity]' while `first <= n < first + count'.
+//     New lines wait in `pending' until `histflush' of them are ready
+//     to go to the history file in a single write.
+//
+static struct {
+    char **lines;
+    int capacity;
+    int count;
+    int first;
+    int fd;            // history file opened for appending, or -1
+    bool opened;       // whether opening `fd' has been tried
+    char *pending;     // lines not yet written to `fd'
+    size_t pending_length;
+    size_t pending_size;
+    int pending_count;
+} history;
+
+//
+// Job table:
+//     Every command that starts programs is a job until all of them
+//     have been reaped.  A foreground job is waited for straight away;
+//     a background job (one ending in `&') stays in the table until
+//     its exit statuses have been reported, before the next prompt or
+//     by `jobs', `wait' or `fg'.  Only pids in the table are ever
+//     reaped, by the event loop.
+//
+struct job {
+    int id;          // the number `jobs', `wait' and `fg' know it by
+    char *command;   // the command line, without the `&'
+    pid_t *pids;
+    int *pidfds;     // -1 once reaped, or if there was no pidfd,
+                     // PIDFD_ZYGOTE if the zygote started it, or
+                     // PIDFD_THREAD for a stage run on a thread
+    char **programs; // the program each pid runs, NULL if not reported
+    int *statuses;   // the wait status of each pid once it is reaped
+    bool *reaped;
+    struct stage_thread **threads; // the thread each stage runs on, or NULL
+    int count;
+    int capacity;
+    int running;     // pids not reaped yet
+    int reported;    // pids whose exit status has been printed, in order
+    bool background;
+};
+
+static struct {
+    struct job **list;
+    int count;
+    int capacity;
+} jobs;
+
+#define PIDFD_ZYGOTE (-2)
+#define PIDFD_THREAD (-3)
+
+//
+// Last status:
+//     The exit status of the last command, which `msh -c' exits with:
+//     the last program's in a pipeline, or 128 plus the signal that
+//     killed it, 127 if the program wasn't found, and 1 after any other
+//     error.
+//
+static int last_status;
+
+//
+// Event loop:
+//     One epoll instance watches standard input while a line is being
+//     read, a pidfd for every child in the job table, and a signalfd
+//     for SIGCHLD, which catches any child that a pidfd couldn't be
+//     opened for.  SIGCHLD stays blocked so it is only ever seen
+//     through the signalfd.  Pipeline stages running on threads write
+//     to an eventfd when they finish.
+//
+#define EVENT_INPUT UINT64_MAX
+#define EVENT_SIGCHLD (UINT64_MAX - 1)
+#define EVENT_ZYGOTE (UINT64_MAX - 2)
+#define EVENT_THREAD (UINT64_MAX - 3)
+
+static struct {
+    int epoll_fd;
+    int signal_fd;
+    int thread_fd;
+    int input_fd;  // the fd read_line has added, or -1
+    int unwatched; // children in the job table without a pidfd
+} events = {
+    .epoll_fd = -1, .signal_fd = -1, .thread_fd = -1, .input_fd = -1};
+
+//
+// Admission control:
+//     Before msh starts one more of the commands it runs side by side ---
+//     `msh -j' lines, `argjobs' batches and `shard -k' copies --- it asks
+//     `admit'.  Every `ADMIT_RECHECK_MS' that reads how much of the last
+//     ten seconds tasks spent stalled on the CPU, memory and I/O from
+//     /proc/pressure, and the load average, and halves how many may run
+//     at once when any of them is over its threshold, or lets one more
+//     run when none is.  There is always room for one.  A kernel without
+//     /proc/pressure leaves just the load average.
+//
+enum admit_resource {
+    ADMIT_CPU,
+    ADMIT_MEMORY,
+    ADMIT_IO,
+    N_ADMIT_RESOURCES,
+};
+
+static const char *const admit_files[N_ADMIT_RESOURCES] = {
+    "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"};
+
+static struct {
+    pthread_mutex_t lock; // `shard' asks from its thread
+    bool opened;
+    int fds[N_ADMIT_RESOURCES]; // the pressure files, -1 if missing
+    int load_fd;                // /proc/loadavg
+    struct timespec checked;    // when they were last read
+    double pressure[N_ADMIT_RESOURCES]; // "some avg10", or -1
+    double load;                        // or -1
+    long window; // how many may run at once, 0 until first asked
+    long limit;  // the most the last caller wanted to run at once
+    bool busy;   // whether the last reading was over a threshold
+    unsigned long checks;
+    unsigned long admitted;
+    unsigned long deferred;
+    unsigned long decreases;
+    unsigned long increases;
+} admission = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+//
+// Spawn actions:
+//     What to do to a new program's file descriptors before it runs:
+//     open a file as `fd', or duplicate `source' as `fd'.  They are
+//     applied in order, by either spawn path.
+//
+enum spawn_action_kind { SPAWN_OPEN, SPAWN_DUP2 };
+
+struct spawn_action {
+    enum spawn_action_kind kind;
+    int fd;
+    int source;       // SPAWN_DUP2
+    const char *path; // SPAWN_OPEN
+    int flags;        // SPAWN_OPEN
+};
+
+struct spawn_actions {
+    struct spawn_action list[SPAWN_MAX_ACTIONS];
+    int count;
+};
+
+//
+// Fast spawn:
+//     With the `fastspawn' option on, programs are started by clone(2)
+//     with CLONE_VM | CLONE_VFORK, so nothing of msh's memory is copied
+//     however big it is, and CLONE_PIDFD hands back the child's pidfd.
+//     The child runs on a stack carved out of the caller's own until it
+//     execs, so any thread may spawn, and leaves the errno of whatever
+//     failed in `error'.  If the kernel refuses, msh falls back to
+//     posix_spawn for good.
+//
+struct spawn_request {
+    char *path;
+    struct spawn_actions *actions;
+    char **arguments;
+    char **environment;
+    int error;
+};
+
+static atomic_bool spawn_fast_works = true;
+
+//
+// Zygote:
+//     With the `zygote' option on, msh forks a helper as it starts,
+//     while its memory is still small, and asks it to start programs
+//     over a SEQPACKET socket: the path, arguments, environment and fd
+//     actions in one message, with msh's current directory and the fds
+//     to duplicate passed as SCM_RIGHTS.  The zygote forks, execs and
+//     reaps each program, replying with its pid, and later its exit
+//     status and resource usage, which msh adds up per program.
+//
+enum zygote_message_type { ZYGOTE_SPAWN, ZYGOTE_STARTED, ZYGOTE_EXITED };
+
+struct zygote_message {
+    enum zygote_message_type type;
+    pid_t pid;      // ZYGOTE_STARTED and ZYGOTE_EXITED
+    int error;      // ZYGOTE_STARTED: why the program couldn't start, or 0
+    int status;     // ZYGOTE_EXITED: its wait status
+    long spawn_ns;  // ZYGOTE_EXITED: from fork to exec
+    long run_ns;    // ZYGOTE_EXITED: from fork to exit
+    long user_ns;   // ZYGOTE_EXITED: CPU time
+    long system_ns;
+    int n_actions;  // ZYGOTE_SPAWN
+    struct spawn_action actions[SPAWN_MAX_ACTIONS];
+    int n_arguments;
+    int n_environment;
+    // followed by '\0'-terminated strings: for ZYGOTE_SPAWN the path, the
+    // file each SPAWN_OPEN action opens, the arguments and the
+    // environment; for ZYGOTE_EXITED the path.  SPAWN_DUP2 sources are
+    // indexes into the fds sent with the message.
+};
+
+// a program the zygote is running
+struct zygote_child {
+    pid_t pid;
+    char *path;
+    struct timespec started;
+    long spawn_ns;
+};
+
+struct zygote_stat {
+    char *path;
+    unsigned long runs;
+    long spawn_ns;
+    long run_ns;
+    long user_ns;
+    long system_ns;
+    struct zygote_stat *next;
+};
+
+static struct {
+    pid_t pid;    // 0 if not started yet, -1 if it couldn't be or has gone
+    int fd;       // our end of the socket, or -1
+    char *buffer; // ZYGOTE_MESSAGE_SIZE bytes for messages
+    struct zygote_stat *stats[ZYGOTE_STATS_BUCKETS];
+    int n_stats;
+} zygote = {.fd = -1};
+
+//
+// Spawn attributes:
+//     Passed to every posix_spawn, so programs start with no signals
+//     blocked even though msh blocks SIGCHLD.
+//
+static posix_spawnattr_t spawn_attributes;
+
+//
+// Builtin utilities:
+//     Common programs that msh runs itself rather than start a process
+//     for.  Each takes the words of its command line and the fds to
+//     read and write, and returns its exit status.  `command NAME' runs
+//     the real program instead.
+//
+//     A utility with `accepts' only runs inside msh when that says so
+//     for the words of the command line, which end at NULL or at the
+//     first redirection, pipe or `&'; otherwise the program is run.
+//
+typedef int utility_fn(char **words, int in, int out);
+
+struct utility {
+    const char *name;
+    utility_fn *run;
+    bool (*accepts)(char **words);
+};
+
+// a file, or standard output, that `tee' copies to
+struct tee_output {
+    int fd;
+    char *name;
+    bool pipe;   // tee(2) can copy to it directly
+    bool failed; // it couldn't be written, so is left out from now on
+};
+
+// the options of the `wc', `head', `tail' and `grep' filters
+struct filter_options {
+    bool lines;  // wc -l
+    bool words;  // wc -w
+    bool bytes;  // wc -c
+    long count;  // head and tail -n
+    bool invert; // grep -v
+    bool counts; // grep -c
+    bool quiet;  // grep -q
+    char *pattern;
+    char *file; // NULL for standard input
+};
+
+// a growing string, for output built up before it is written
+struct buffer {
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+// the state of `test' working through its expression
+struct test_parser {
+    char **words;
+    int count;
+    int at;
+    bool error;
+};
+
+// a copy of the program `shard' runs
+struct shard_worker {
+    pid_t pid;
+    int in;  // the pipe to its standard input, or -1 once closed
+    int out; // the pipe from its standard output, or -1 at its end
+    char *block; // input to write to it, or NULL
+    size_t block_length;
+    size_t written;
+    struct buffer output; // output it has written that isn't out yet
+};
+
+// `shard' running copies of a program, the first with -k being the one
+// whose output goes out next
+struct shard {
+    char **arguments;
+    char *program; // the pathname of arguments[0]
+    bool ordered;
+    int out;
+    struct shard_worker *workers;
+    int n_workers;
+    int next; // where to look for an idle copy next
+    int status;
+};
+
+//
+// Command syntax tree:
+//     `parse' reads the words of a command line once, from left to
+//     right, building this tree for it in the command arena:
+//
+//         line        := pipeline ['&']
+//         pipeline    := command {'|' command}
+//         command     := {word | redirection}
+//         redirection := '<' word | '>' word | '>' '>' word
+//
+//     A command needs at least one word.  Its redirections may come
+//     anywhere among them, at most one for each fd, and take the place
+//     of the pipe it would otherwise read or write.  Each command's
+//     arguments are a slice of one array of the line's words, with the
+//     redirections taken out, so nothing looks through the words again.
+//
+
+// `< FILE' (fd 0), or `> FILE' or `>> FILE' (fd 1), opened with flags
+struct redirect {
+    int fd;
+    int flags;
+    char *path;
+};
+
+struct command {
+    char **argv;      // ends in NULL
+    bool *needs_glob; // whether each word of argv is a pattern
+    int argc;
+    struct redirect *redirects;
+    int n_redirects;
+    bool external;   // `command NAME', which never runs a builtin
+    bool *matched;   // whether each word of argv is one a pattern matched,
+                     // NULL if there were no patterns
+};
+
+struct pipeline {
+    struct command *commands;
+    int count;
+    bool background; // the line ended in `&'
+};
+
+// the state of `parse' working through a line
+struct parser {
+    char **words;
+    bool *needs_glob;
+    int count; // words, not counting a final `&'
+    int at;
+    char **argv;                // where the next command's arguments go
+    bool *argv_glob;
+    struct redirect *redirects; // where its redirections go
+};
+
+//
+// Pipeline stages:
+//     What runs each part of a pipeline: a program, a builtin utility
+//     (on a thread of its own), or the output of a builtin, which was
+//     run before the pipeline started and is written out by a thread.
+//
+struct stage {
+    char *program; // the path of the program, or NULL
+    char **arguments;
+    const struct utility *utility;
+    char *output; // a builtin's malloc'd output
+    size_t output_length;
+    int status;   // and its exit status
+};
+
+// a stage running on a thread; it owns its fds, arguments and output
+struct stage_thread {
+    pthread_t thread;
+    const struct utility *utility;
+    char **arguments;
+    char *output;
+    size_t output_length;
+    int in;
+    int out;
+    int status;
+    atomic_bool done;
+};
+
+//
+// Batch mode:
+//     `msh -j N' runs each line of its input as a command of its own, up
+//     to N at once.  Each one is a job, run by a copy of msh started as
+//     `msh -c LINE' with its standard output and error going to pipes.
+//     What a command writes is kept until it has finished and then
+//     written out in one go, so commands' output never mixes.  With
+//     --keep-order it comes out in the order the lines were read, and
+//     the oldest command still running writes straight through.
+//
+struct batch_job {
+    struct job *job;
+    long line;              // where it was in the input
+    int fds[2];             // the pipes from its standard output and
+                            // error, -1 once they are at their end
+    struct buffer output[2]; // what it has written that isn't out yet
+    bool finished;
+};
+
+static struct {
+    struct batch_job **queue; // in the order they were read
+    int count;
+    int capacity;
+    int running;              // started but not finished
+    long started;
+    long finished;
+    long failed;
+    struct buffer failures;   // a line for each command that failed
+    bool keep_order;
+    bool progress;
+} batch;
+
+static void execute_command(char **words, bool *needs_glob, char **path,
+                            char **environment);
 // Subset 0
-static void pwd();
-static void cd(char **words);
+static int pwd(FILE *out);
+static int cd(char **words);
 // Subset 1
-static void run_program(char *pathname, char **words, char **environment);
+static void run_program(char *pathname, struct command *command,
+                        char **environment, struct job *job);
 // Subset 2
+static char *history_file(void);
+static void history_append(const char *line, size_t length);
+static void history_resize(int capacity);
+static void history_load(void);
+static void history_open(void);
+static void history_flush(void);
 static void store_command(char **words);
-static void print_history(int num);
+static void print_history(FILE *out, int num);
 static int history_check_arg(int *print_num, int count, char **words);
-static int exclamation_check_arg(int *num, int count, char **words);
+static int exclamation_check_arg(int *num, int *first_extra, int count,
+                                 char **words);
 static char *load_command(int command_num);
 // Subset 3
-static char *check_glob(char **words);
+static char **check_glob(char **words, bool *needs_glob, bool **matched);
+static void glob_pattern(char *pattern);
+static void glob_walk(char *dir, char *rest);
+static void glob_walk_recursive(char *dir, char *next, size_t slashes);
+static void *glob_walk_thread(void *arg);
+static void glob_walk_dir(struct glob_worker *worker, char *path);
+static char *glob_walk_join(struct glob_worker *worker, char *path,
+                            size_t path_length, char *name, size_t length,
+                            char *suffix, size_t suffix_length);
+static void glob_walk_found(struct glob_worker *worker, char *path,
+                            size_t path_length, char *name, size_t length);
+static void glob_walk_push(struct glob_worker *worker, char *path);
+static char *glob_walk_pop(struct glob_worker *worker, bool steal);
+static void glob_add_match(char *path);
+static struct glob_compiled *glob_compile(const char *pattern, size_t length);
+static size_t glob_compile_class(const char *pattern, size_t length,
+                                 struct glob_op *op);
+static bool glob_match(struct glob_compiled *compiled, const char *name,
+                       size_t length);
+static struct dir_listing *glob_list_dir(char *dir);
+static bool glob_cache_persistent(void);
+static void glob_cache_refresh(void);
+static void glob_cache_forget(int watch);
+static void glob_cache_end_command(void);
+static void glob_cache_clear(void);
+static void free_listing(struct dir_listing *listing);
 // Subset 4
-static int redirection_check_arg(int count, int *input, int *output,
-                                 int *pipe_count, char **words);
-static void in_out_redirection(int max, char *program, int input, int output,
-                               char **words, char **environment);
+static struct pipeline *parse(char **words, bool *needs_glob);
+static bool parse_pipeline(struct parser *parser, struct pipeline *pipeline);
+static bool parse_command(struct parser *parser, struct command *command);
+static bool parse_redirect(struct parser *parser, struct command *command);
+static bool is_operator(char *word);
+static char **pipeline_words(struct pipeline *pipeline);
+static struct redirect *redirect_find(struct command *command, int fd);
+static bool redirect_check(struct command *command);
+static void redirect_actions(struct command *command,
+                             struct spawn_actions *actions);
+static size_t argument_size(char **words, int from, int to);
+static void run_batches(char *program, struct command *command,
+                        char **environment, struct job *job);
 // Subset 5
-static char **get_programs(int max, char **words, int input, int output,
-                           char **path);
-static char **get_arguments(int max, char **words, int input, int output,
-                            int program_num);
-static void pipes(int max, char **program, int input, int output,
-                  int pipe_count, char **words, char **environment);
+static struct stage *get_stages(struct pipeline *pipeline, char **path);
+static void pipes(struct pipeline *pipeline, struct stage *stages,
+                  char **environment, struct job *job);
+static void pipe_resize(int fd, bool utility_reads, int n_pipes);
+static long proc_long(const char *path, long fallback);
+static void stage_start(struct job *job, struct stage *stage, int in,
+                        int out);
+static void *stage_thread_run(void *arg);
+static void stage_free(struct stage_thread *thread);
+// Spawning
+static void spawn_add_open(struct spawn_actions *actions, int fd,
+                           const char *path, int flags);
+static void spawn_add_dup2(struct spawn_actions *actions, int source, int fd);
+static int spawn(pid_t *pid, int *pidfd, char *path,
+                 struct spawn_actions *actions, char **arguments,
+                 char **environment);
+static int spawn_direct(pid_t *pid, int *pidfd, char *path,
+                        struct spawn_actions *actions, char **arguments,
+                        char **environment);
+static int spawn_child(void *arg);
+// Builtin utilities
+static const struct utility *find_utility(char **words);
+static void run_in_process(struct command *command);
+static int run_builtin(char **words, FILE *out);
+static bool write_all(int fd, const char *s, size_t length);
+static utility_fn utility_true;
+static utility_fn utility_false;
+static utility_fn utility_echo;
+static utility_fn utility_printf;
+static int printf_escape(char *s, struct buffer *result, bool argument,
+                         bool *stop);
+static void buffer_add(struct buffer *buffer, const char *s, size_t length);
+static void buffer_format(struct buffer *buffer, const char *format, ...);
+static utility_fn utility_test;
+static char *test_peek(struct test_parser *parser, int ahead);
+static bool test_or(struct test_parser *parser);
+static bool test_and(struct test_parser *parser);
+static bool test_not(struct test_parser *parser);
+static bool test_binary_operator(char *s);
+static bool test_primary(struct test_parser *parser);
+static bool test_integer(char *s, long long *value);
+static bool test_unary(char operator, char *operand,
+                       struct test_parser *parser);
+static utility_fn utility_sleep;
+static utility_fn utility_cat;
+static utility_fn utility_tee;
+static int tee_splice(int in, struct tee_output *outputs, int n_outputs);
+static bool tee_splice_output(struct tee_output *output, int scratch,
+                              int spare[2], int null, size_t n);
+static bool splice_all(int from, int to, size_t length);
+static int tee_copy(int in, struct tee_output *outputs, int n_outputs);
+static utility_fn utility_shard;
+static void shard_run(struct shard *shard, int in, long jobs);
+static struct shard_worker *shard_idle(struct shard *shard, long jobs);
+static bool shard_start(struct shard *shard, struct shard_worker *worker);
+static bool shard_step(struct shard *shard, struct shard_worker *worker,
+                       bool head);
+static void shard_finish(struct shard *shard, int i);
+// Filters
+static bool filter_end(char *word);
+static bool wc_options(char **words, struct filter_options *options);
+static bool lines_options(char **words, struct filter_options *options);
+static bool grep_options(char **words, struct filter_options *options);
+static bool wc_accepts(char **words);
+static bool lines_accepts(char **words);
+static bool grep_accepts(char **words);
+static int filter_open(char *name, struct filter_options *options, int in);
+static size_t count_byte(const char *s, size_t length, char c);
+static size_t count_byte_scalar(const char *s, size_t length, char c);
+#ifdef MSH_X86_SIMD
+static size_t count_byte_sse2(const char *s, size_t length, char c);
+static size_t count_byte_avx2(const char *s, size_t length, char c);
+#endif
+static utility_fn utility_wc;
+static utility_fn utility_head;
+static utility_fn utility_tail;
+static int tail_file(int fd, off_t size, long lines, int out);
+static size_t tail_start(const char *data, size_t length, long lines);
+static utility_fn utility_grep;
+static bool grep_lines(struct filter_options *options, char *data,
+                       size_t length, struct buffer *output,
+                       unsigned long *matches);
+
+static const struct utility utilities[] = {
+    {"true", utility_true, NULL},   {"false", utility_false, NULL},
+    {"echo", utility_echo, NULL},   {"printf", utility_printf, NULL},
+    {"test", utility_test, NULL},   {"[", utility_test, NULL},
+    {"sleep", utility_sleep, NULL}, {"cat", utility_cat, NULL},
+    {"tee", utility_tee, NULL},     {"shard", utility_shard, NULL},
+    {"wc", utility_wc, wc_accepts},
+    {"head", utility_head, lines_accepts},
+    {"tail", utility_tail, lines_accepts},
+    {"grep", utility_grep, grep_accepts},
+};
 
+// Zygote
+static void zygote_start(void);
+static void zygote_main(int fd) __attribute__((noreturn));
+static int zygote_fork(char *buffer, ssize_t length, int *fds, int n_fds,
+                       struct zygote_child *child);
+static ssize_t zygote_receive(int fd, char *buffer, int *fds, int *n_fds,
+                              int flags);
+static int zygote_spawn(pid_t *pid, char *path, struct spawn_actions *actions,
+                        char **arguments, char **environment);
+static char *zygote_pack(char *start, char *end, const char *s);
+static void zygote_read(void);
+static void zygote_exited(struct zygote_message *message, ssize_t length);
+static void zygote_lost(void);
+static long elapsed_ns(struct timespec *start);
+static int zygote_command(char **words, FILE *out);
+// Jobs
+static bool is_builtin(char *program);
+static bool is_printing_builtin(char *program);
+static void events_init(void);
+static bool event_wait(int fd, long timeout);
+static long event_timeout(struct timespec *deadline);
+static void job_reap(struct job *job, int i);
+static struct job *job_new(char **words, bool background);
+static void job_add(struct job *job, pid_t pid, int pidfd, char *program);
+static void job_wait(struct job *job, int running, struct timespec *deadline);
+static void job_report(struct job *job);
+static void job_finish(struct job *job);
+static void job_remove(struct job *job);
+static struct job *job_find(char *name, char *builtin);
+static void jobs_notify(void);
+static int jobs_command(char **words, FILE *out);
+static int wait_command(char **words);
+static int fg_command(char **words);
+
+// Batch mode
+static int batch_run(long max_jobs, char **environment);
+static void batch_start(char *line, long number, char **environment);
+static void batch_poll(long timeout);
+static void batch_read(struct batch_job *job, int which);
+static void batch_check(struct batch_job *job);
+static void batch_output(void);
+static void batch_write(struct batch_job *job);
+static void batch_emit(int fd, const char *data, size_t length);
+static void batch_progress(void);
+static int exit_code(int status);
+// Admission control
+static bool admit(long running, long limit);
+static void admit_check(void);
+static double admit_read(int fd, const char *field);
+static int admit_command(char **words, FILE *out);
+
+// Shell options
+static void options_init(void);
+static bool parse_option_value(struct option *option, const char *text,
+                               long *value);
+static void print_option(FILE *out, struct option *option);
+static int set_command(char **words, FILE *out);
+static int options_override(char **words);
+static void options_restore(void);
+// Command hash table
+static char **command_path(void);
+static unsigned long hash_string(char *s);
+static char *hash_lookup(char *program, char **path);
+static char *path_search(char *program);
+static struct hash_entry *hash_find(char *program, char **path);
+static void hash_check_directories(void);
+static void hash_clear(void);
+static int hash_command(char **words, FILE *out);
+
+static char *read_line(int fd);
 static void do_exit(char **words);
 static int is_executable(char *pathname);
-static char **tokenize(char *s, char *separators, char *special_chars);
-static void free_tokens(char **tokens);
+static char **tokenize(struct arena *arena, char *s, char *separators,
+                       char *special_chars, bool **needs_glob);
+static bool bitmap_test(const uint64_t *bitmap, size_t i);
+static size_t bitmap_next(const uint64_t *a, const uint64_t *b, bool clear,
+                          size_t from, size_t limit);
+static classify_fn classify_scalar;
+#ifdef MSH_X86_SIMD
+static classify_fn classify_sse2;
+static classify_fn classify_avx2;
+#endif
+static void *arena_alloc(struct arena *arena, size_t size);
+static void arena_shrink(struct arena *arena, void *last, size_t size);
+static char *arena_strdup(struct arena *arena, const char *s);
+static void arena_reset(struct arena *arena);
+static void execute_line(char *line, char **environment);
+static char **tokenize_line(char *line, bool **needs_glob);
 
-int main(void) {
+int main(int argc, char **argv) {
     // Ensure `stdout' is line-buffered for autotesting.
     setlinebuf(stdout);
 
@@ -96,19 +1258,57 @@ int main(void) {
     //     { "VAR1=value", "VAR2=value", NULL }
     extern char **environ;
 
-    // Grab the `PATH' environment variable for our path.
-    // If it isn't set, use the default path defined above.
-    char *pathp;
-    if ((pathp = getenv("PATH")) == NULL) {
-        pathp = (char *)DEFAULT_PATH;
+    // `msh -c COMMAND' runs one command; `msh -j JOBS' runs every line of
+    // its input as a command of its own, JOBS of them at once
+    char *command = NULL;
+    long max_jobs = 0;
+    for (int i = 1; i < argc; i++) {
+        bool usage = false;
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && command == NULL) {
+            command = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            char *end;
+            max_jobs = strtol(argv[++i], &end, 10);
+            usage = *end != '\0' || max_jobs < 1 || max_jobs > BATCH_MAX_JOBS;
+        } else if (strcmp(argv[i], "--keep-order") == 0) {
+            batch.keep_order = true;
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            batch.progress = true;
+        } else {
+            usage = true;
+        }
+        if (usage) {
+            fprintf(stderr, "usage: msh [-c COMMAND] "
+                            "[-j JOBS [--keep-order] [--progress]]\n");
+            return 2;
+        }
+    }
+
+    options_init();
+
+    // Children are reaped by the event loop, before any threads start
+    events_init();
+    if (options[OPTION_ZYGOTE].value) {
+        zygote_start();
+    }
+
+    if (command != NULL) {
+        execute_line(command, environ);
+        return last_status;
+    }
+    if (max_jobs > 0) {
+        return batch_run(max_jobs, environ);
     }
-    char **path = tokenize(pathp, ":", "");
 
     // Should this shell be interactive?
     bool interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    glob_cache.interactive = interactive;
 
     // Main loop: print prompt, read line, execute command
     while (1) {
+        // Report any background jobs that have finished.
+        jobs_notify();
+
         // If `stdout' is a terminal (i.e., we're an interactive shell),
         // print a prompt before reading a line of input.
         if (interactive) {
@@ -116,70 +1316,113 @@ int main(void) {
             fflush(stdout);
         }
 
-        char line[MAX_LINE_CHARS];
-        if (fgets(line, MAX_LINE_CHARS, stdin) == NULL) break;
+        char *line = read_line(STDIN_FILENO);
+        if (line == NULL) break;
 
-        // Tokenise and execute the input line.
-        char **command_words =
-            tokenize(line, (char *)WORD_SEPARATORS, (char *)SPECIAL_CHARS);
-        execute_command(command_words, path, environ);
-        free_tokens(command_words);
+        execute_line(line, environ);
     }
 
-    free_tokens(path);
+    hash_clear();
     return 0;
 }
 
+// Tokenise and execute an input line.
+// The path is fetched per command so a changed `$PATH' is noticed.
+static void execute_line(char *line, char **environment) {
+    bool *needs_glob;
+    char **command_words = tokenize_line(line, &needs_glob);
+    execute_command(command_words, needs_glob, command_path(), environment);
+    options_restore();
+    glob_cache_end_command();
+    arena_reset(&command_arena);
+}
+
+// Tokenise line into the command arena, with a `!' at its start as a word
+// of its own, e.g. `!4' is `!' and `4'
+static char **tokenize_line(char *line, bool **needs_glob) {
+    char *start = line + strspn(line, WORD_SEPARATORS);
+    if (*start != '!') {
+        return tokenize(&command_arena, line, (char *)WORD_SEPARATORS,
+                        (char *)SPECIAL_CHARS, needs_glob);
+    }
+    bool *rest_glob;
+    char **rest = tokenize(&command_arena, start + 1, (char *)WORD_SEPARATORS,
+                           (char *)SPECIAL_CHARS, &rest_glob);
+    int count = 0;
+    while (rest[count] != NULL) {
+        count++;
+    }
+    char **words = arena_alloc(&command_arena, (count + 2) * sizeof *words);
+    *needs_glob =
+        arena_alloc(&command_arena, (count + 2) * sizeof **needs_glob);
+    words[0] = arena_alloc(&command_arena, 2);
+    strcpy(words[0], "!");
+    (*needs_glob)[0] = false;
+    memcpy(words + 1, rest, (count + 1) * sizeof *words);
+    memcpy(*needs_glob + 1, rest_glob, (count + 1) * sizeof **needs_glob);
+    return words;
+}
+
 //
 // Execute a command, and wait until it finishes.
 //
 //  * `words': a NULL-terminated array of words from the input command line
+//  * `needs_glob': whether each word has characters to expand
 //  * `path': a NULL-terminated array of directories to search in;
 //  * `environment': a NULL-terminated array of environment variables.
 //
-static void execute_command(char **words, char **path, char **environment) {
+static void execute_command(char **words, bool *needs_glob, char **path,
+                            char **environment) {
     assert(words != NULL);
     assert(path != NULL);
     assert(environment != NULL);
 
-    char *program = words[0];
-
-    // count the number of arguments in words
-    int number_arguments = 0;
-    while (words[number_arguments] != NULL) {
-        number_arguments++;
+    if (words[0] == NULL) {
+        // nothing to do
+        last_status = 0;
+        return;
     }
+    // until something runs, this is an error
+    last_status = 1;
 
-    if (program == NULL) {
-        // nothing to do
+    // leading NAME=VALUE words set options for just this command; they
+    // are still stored in the history
+    char **line_words = words;
+    int n_overrides = options_override(words);
+    if (n_overrides == -1) {
+        // error already printed
+        return;
+    }
+    words += n_overrides;
+    needs_glob += n_overrides;
+    if (words[0] == NULL) {
+        store_command(line_words);
+        last_status = 0;
         return;
     }
 
     // Subset 4 & 5
-    // count number of '<', '>', and '|'
-    // returns 1 if arguments are invalid
-    int input_r = 0, output_r = 0, pipe_count = 0;
-    int invalid_redir = redirection_check_arg(number_arguments, &input_r,
-                                              &output_r, &pipe_count, words);
-    if (invalid_redir) {
+    // parse the '<', '>', '>>', '|' and '&' into a tree of commands
+    struct pipeline *pipeline = parse(words, needs_glob);
+    if (pipeline == NULL) {
         // error already printed
         return;
     }
 
     // Subset 2
     // Checks if '!' is called. Returns new words depending on number chosen
-    if (strcmp(program, "!") == 0) {
-        if (input_r || output_r || pipe_count) {
-            fprintf(stderr,
-                    "%s: I/O redirection not permitted for builtin commands\n",
-                    program);
-            return;
+    bool exclamation = strcmp(words[0], "!") == 0;
+    if (exclamation) {
+        int number_arguments = 0;
+        while (words[number_arguments] != NULL) {
+            number_arguments++;
         }
         // call the last commmand by default (-1)
         int command_num = -1;
         // check arguments passed in
-        int not_valid =
-            exclamation_check_arg(&command_num, number_arguments, words);
+        int first_extra = 1;
+        int not_valid = exclamation_check_arg(&command_num, &first_extra,
+                                              number_arguments, words);
         if (not_valid) {
             // error already printed
             return;
@@ -187,189 +1430,168 @@ static void execute_command(char **words, char **path, char **environment) {
 
         // load the arguments from history
         char *command = load_command(command_num);
-        printf("%s", command);
         if (command == NULL) {
             // error already printed
             return;
         }
+        // anything after it, e.g. `! 3 | wc -l' or `! > out', is added on
+        if (words[first_extra] != NULL) {
+            size_t length = strlen(command) + 1;
+            for (int i = first_extra; words[i] != NULL; i++) {
+                length += strlen(words[i]) + 1;
+            }
+            char *joined = arena_alloc(&command_arena, length);
+            char *end = stpcpy(joined, command);
+            for (int i = first_extra; words[i] != NULL; i++) {
+                *end++ = ' ';
+                end = stpcpy(end, words[i]);
+            }
+            command = joined;
+        }
+        printf("%s\n", command);
         // modify the words to be passed on to execution
         // e.g !4 to the 4th element stored in history
-        words =
-            tokenize(command, (char *)WORD_SEPARATORS, (char *)SPECIAL_CHARS);
-        // update program as well
-        program = words[0];
-        // check new words for subset 4
-        number_arguments = 0;
-        while (words[number_arguments] != NULL) {
-            number_arguments++;
-        }
-        // re-count '>', '<', '|' after the new words
-        input_r = 0;
-        output_r = 0;
-        pipe_count = 0;
-        invalid_redir = redirection_check_arg(number_arguments, &input_r,
-                                              &output_r, &pipe_count, words);
-        if (invalid_redir) {
+        words = tokenize_line(command, &needs_glob);
+        // parse the new words instead
+        pipeline = parse(words, needs_glob);
+        if (pipeline == NULL) {
             // error already printed
             return;
         }
     }
 
     // Store the command after program is NULL or '!'
-    store_command(words);
+    store_command(exclamation ? words : line_words);
 
-    // e.g. if "< hi.txt wc" is passed we need to change program from '<' to wc
-    if (strcmp(program, "<") == 0) {
-        program = words[2];
+    struct command *command = &pipeline->commands[0];
+    char *program = command->argv[0];
+    bool background = pipeline->background;
+    if (background && !command->external &&
+        (strcmp(program, "exit") == 0 || is_builtin(program))) {
+        fprintf(stderr, "%s: builtin commands cannot run in the background\n",
+                program);
+        return;
     }
 
-    if (strcmp(program, "exit") == 0) {
-        do_exit(words);
+    if (pipeline->count == 1 && !command->external &&
+        strcmp(program, "exit") == 0) {
+        do_exit(command->argv);
         // `do_exit' will only return if there was an error.
         return;
     }
 
     // Subset 3
-    // checks if '*' was called, returns list of arguments if called or NULL if
-    // not called
-    char *new_word = check_glob(words);
-    if (new_word != NULL) {
-        // update words to new arguments
-        words =
-            tokenize(new_word, (char *)WORD_SEPARATORS, (char *)SPECIAL_CHARS);
+    // checks if '*' was called in each command's arguments, and puts the
+    // matches in place of each pattern
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command *c = &pipeline->commands[i];
+        char **expanded = check_glob(c->argv, c->needs_glob, &c->matched);
+        if (expanded != NULL) {
+            // update the arguments to the new ones
+            c->argv = expanded;
+            c->argc = 0;
+            while (c->argv[c->argc] != NULL) {
+                c->argc++;
+            }
+        }
     }
 
-    // Subset 0: pwd and cd
-    if (strcmp(program, "pwd") == 0) {
-        if (input_r || output_r || pipe_count) {
-            fprintf(stderr,
-                    "%s: I/O redirection not permitted for builtin commands\n",
-                    program);
-            return;
-        }
-        // check the arguments
-        if (number_arguments == 1) {
-            pwd();
-        } else {
-            fprintf(stderr, "pwd: too many arguments\n");
-        }
+    // builtins, and builtin utilities unless they are in the background,
+    // run inside msh; pipelines run utilities on threads
+    if (pipeline->count == 1 && !command->external &&
+        (is_builtin(program) || (find_utility(command->argv) && !background))) {
+        run_in_process(command);
         return;
+    }
 
-    } else if (strcmp(program, "cd") == 0) {
-        if (input_r || output_r || pipe_count) {
-            fprintf(stderr,
-                    "%s: I/O redirection not permitted for builtin commands\n",
-                    program);
+    if (pipeline->count > 1) {
+        // Subset 5 with pipes
+        struct stage *stages = get_stages(pipeline, path);
+        if (stages == NULL) {
+            // error already printed
             return;
         }
-        // check the arguments
-        if (number_arguments <= 2) {
-            cd(words);
-        } else {
-            fprintf(stderr, "cd: too many arguments\n");
-        }
-        return;
-    }
-
-    // Subset 2
-    // check if 'history' was called
-    if (strcmp(program, "history") == 0) {
-        if (input_r || output_r || pipe_count) {
-            fprintf(stderr,
-                    "%s: I/O redirection not permitted for builtin commands\n",
-                    program);
-            return;
-        }
-        // history called, print the command history
-        int print_num = DEFAULT_HISTORY_SHOWN;
-        // check the arguments
-        int not_valid = history_check_arg(&print_num, number_arguments, words);
-        if (not_valid) {
-            return;
-        }
-        print_history(print_num);
+        // the job is waited for, or announced, once every stage is started
+        struct job *job = job_new(pipeline_words(pipeline), background);
+        pipes(pipeline, stages, environment, job);
+        job_finish(job);
         return;
     }
 
     // Subset 1
-    char pathname[MAX_LINE_CHARS];
+    char *pathname = program;
     if (strrchr(program, '/') == NULL) {
         // if the program name has no '/'
-        // we need to find a valid path to the program
-        for (int i = 0; path[i] != NULL; i++) {
-            strcpy(pathname, path[i]);
-            strcat(pathname, "/");
-            strcat(pathname, program);
-            // loop through all the possible pathnames in $PATH
-            if (is_executable(pathname)) {
-                program = pathname;
-                break;
-            }
-        }
+        // the hash table finds a valid path to the program
+        pathname = hash_lookup(program, path);
+    } else if (!is_executable(program)) {
+        pathname = NULL;
     }
     // if program is executable we run it, else print error
-    if (is_executable(program)) {
-        if (!pipe_count) {
-            if (input_r == 0 && output_r == 0) {
-                // run program normally via posix_spawn
-                run_program(program, words, environment);
-            } else {
-                // Subset 4 with '<' and '>'
-                in_out_redirection(number_arguments, program, input_r, output_r,
-                                   words, environment);
-            }
+    if (pathname != NULL) {
+        program = pathname;
+        // the job is waited for, or announced, once every program is
+        // started
+        struct job *job = job_new(pipeline_words(pipeline), background);
+        long limit = sysconf(_SC_ARG_MAX) - ARG_HEADROOM -
+                     argument_size(environment, 0, -1);
+        if (command->matched != NULL && options[OPTION_ARGBATCH].value &&
+            (long)argument_size(command->argv, 0, command->argc) > limit) {
+            // too long to run in one go, run the matches in batches
+            run_batches(program, command, environment, job);
         } else {
-            // Subset 5 with pipes
-            char **programs =
-                get_programs(number_arguments, words, input_r, output_r, path);
-            if (programs == NULL) {
-                // builtin command called, error already printed
-                return;
-            }
-            pipes(number_arguments, programs, input_r, output_r, pipe_count,
-                  words, environment);
-            free_tokens(programs);
+            // run program via posix_spawn, with any '<', '>' or '>>'
+            run_program(program, command, environment, job);
         }
+        job_finish(job);
     } else {
         fprintf(stderr, "%s: command not found\n", program);
+        last_status = 127;
     }
 }
 
-static void pwd() {
-    char cwd[MAX_LINE_CHARS];
-    if (getcwd(cwd, sizeof cwd) == NULL) {
+static int pwd(FILE *out) {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
         perror("getcwd");
+        return 1;
     }
-    printf("current directory is '%s'\n", cwd);
+    fprintf(out, "current directory is '%s'\n", cwd);
+    free(cwd);
+    return 0;
 }
 
-static void cd(char **words) {
+static int cd(char **words) {
     char *home = getenv("HOME");
     if (words[1] == NULL) {
         // no arguments, change to HOME environment variable
-        chdir(home);
-    } else {
-        if (chdir(words[1]) != 0) {
-            fprintf(stderr, "cd: %s: No such file or directory\n", words[1]);
-        }
+        return home != NULL && chdir(home) == 0 ? 0 : 1;
     }
-}
-
-// posix_spawn to run an executable program
-static void run_program(char *pathname, char **words, char **environment) {
-    pid_t pid;
-    if (posix_spawn(&pid, pathname, NULL, NULL, words, environment) != 0) {
-        perror("spawn");
+    if (chdir(words[1]) != 0) {
+        fprintf(stderr, "cd: %s: No such file or directory\n", words[1]);
+        return 1;
     }
+    return 0;
+}
 
-    // wait for program to finish
-    int exit_status;
-    if (waitpid(pid, &exit_status, 0) == -1) {
-        perror("waitpid");
+// spawn an executable program as part of job, running command with its
+// '<', '>' or '>>' applied
+static void run_program(char *pathname, struct command *command,
+                        char **environment, struct job *job) {
+    if (!redirect_check(command)) {
+        return;
     }
-    if (WIFEXITED(exit_status)) {
-        printf("%s exit status = %d\n", pathname, WEXITSTATUS(exit_status));
+    struct spawn_actions actions = {.count = 0};
+    redirect_actions(command, &actions);
+    pid_t pid;
+    int pidfd;
+    int err =
+        spawn(&pid, &pidfd, pathname, &actions, command->argv, environment);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", pathname, strerror(err));
+        return;
     }
+    job_add(job, pid, pidfd, pathname);
 }
 
 // Checks the arguments and edge cases for 'history' call
@@ -402,14 +1624,11 @@ static int history_check_arg(int *print_num, int count, char **words) {
     return 0;
 }
 
-// Checks the arguments and edge cases for '!' call
-static int exclamation_check_arg(int *num, int count, char **words) {
-    if (count > 2) {
-        // "!" "something" something...
-        fprintf(stderr, "!: too many arguments\n");
-        return 1;
-    }
-    if (count == 2) {
+// Checks the arguments and edge cases for '!' call, and sets first_extra to
+// the first word to add on to the command from history
+static int exclamation_check_arg(int *num, int *first_extra, int count,
+                                 char **words) {
+    if (count >= 2 && strchr(SPECIAL_CHARS, words[1][0]) == NULL) {
         // "!" SOMETHING
         int is_num = 1;
         // go through words[1] to see if it is numerical
@@ -420,127 +1639,240 @@ static int exclamation_check_arg(int *num, int count, char **words) {
         }
         if (is_num) {
             *num = atoi(words[1]);
+            *first_extra = 2;
         } else {
             fprintf(stderr, "!: %s: numeric argument required\n", words[1]);
             return 1;
         }
     }
-    // otherwise 1 argument of '!'
+    // otherwise '!' on its own, or followed by redirections and pipes
     // command_num set to last by default
     return 0;
 }
 
-// Given the number after history call (or 10 by default), prints the lines of
-// history
-static void print_history(int num) {
-    char path[MAX_LINE_CHARS];
-    strcpy(path, getenv("HOME"));
-    strcat(path, "/.msh_history");
+// Returns the malloc'd pathname of the history file, `$HOME/.msh_history'
+static char *history_file(void) {
+    char *home = getenv("HOME");
+    if (home == NULL) {
+        fprintf(stderr, "msh_history: $HOME not set\n");
+        return NULL;
+    }
+    size_t length = strlen(home) + strlen("/.msh_history") + 1;
+    char *path = malloc(length);
+    assert(path != NULL);
+    snprintf(path, length, "%s/.msh_history", home);
+    return path;
+}
+
+// Adds a line to the end of the in-memory history, dropping the oldest line
+// once the ring is full
+static void history_append(const char *line, size_t length) {
+    if (options[OPTION_HISTSIZE].value != history.capacity) {
+        history_resize(options[OPTION_HISTSIZE].value);
+    }
+    if (history.count == history.capacity) {
+        free(history.lines[history.first % history.capacity]);
+        history.first++;
+        history.count--;
+    }
+    char *copy = strndup(line, length);
+    assert(copy != NULL);
+    history.lines[(history.first + history.count) % history.capacity] = copy;
+    history.count++;
+}
+
+// Changes how many lines the ring holds, keeping the most recent ones
+static void history_resize(int capacity) {
+    char **lines = calloc(capacity, sizeof *lines);
+    assert(lines != NULL);
+    int keep = history.count < capacity ? history.count : capacity;
+    int drop = history.count - keep;
+    for (int i = 0; i < history.count; i++) {
+        int n = history.first + i;
+        if (i < drop) {
+            free(history.lines[n % history.capacity]);
+        } else {
+            lines[n % capacity] = history.lines[n % history.capacity];
+        }
+    }
+    free(history.lines);
+    history.lines = lines;
+    history.capacity = capacity;
+    history.first += drop;
+    history.count = keep;
+}
+
+// Reads the history file into memory the first time history is needed
+static void history_load(void) {
+    if (history.lines != NULL) {
+        return;
+    }
+
+    history.capacity = options[OPTION_HISTSIZE].value;
+    history.lines = calloc(history.capacity, sizeof *history.lines);
+    assert(history.lines != NULL);
+    history.fd = -1;
+
+    if (!options[OPTION_HISTORY].value) {
+        // commands are only remembered for this session
+        return;
+    }
+    history_open();
 
+    char *path = history_file();
+    if (path == NULL) {
+        return;
+    }
     FILE *fp = fopen(path, "r");
+    free(path);
     if (fp == NULL) {
-        perror("msh_history");
+        // no history yet
         return;
     }
+    char *line = NULL;
+    size_t size_read = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size_read, fp)) != -1) {
+        if (length > 0 && line[length - 1] == '\n') {
+            length--;
+        }
+        history_append(line, length);
+    }
+    free(line);
+    fclose(fp);
+}
 
-    // Store all the values of the file into an array
-    char data[1000][MAX_LINE_CHARS];
-    int i = 0;
-    while (fgets(data[i], MAX_LINE_CHARS, fp) != NULL) {
-        i++;
+// Opens the history file for appending, keeping one descriptor open for the
+// whole session, creating the file if it doesn't exist, and writing
+// whatever is left when the shell exits
+static void history_open(void) {
+    history.opened = true;
+    char *path = history_file();
+    if (path == NULL) {
+        return;
     }
+    history.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    if (history.fd == -1) {
+        perror("msh_history");
+    } else {
+        atexit(history_flush);
+    }
+}
 
-    fclose(fp);
+// Given the number after history call (or 10 by default), prints the lines of
+// history
+static void print_history(FILE *out, int num) {
+    history_load();
 
-    int starting_point = i - 1 - num;
+    // the last line is the `history' command itself, which isn't shown
+    int end = history.first + history.count - 1;
+    int starting_point = end - num;
     // see if the starting point is valid
-    if (starting_point < 0) {
-        starting_point = 0;
+    if (starting_point < history.first) {
+        starting_point = history.first;
     }
-    // print the rows from starting point up to i - 1
-    for (int j = starting_point; j < i - 1; j++) {
-        printf("%d: %s", j, data[j]);
+    // print the rows from starting point up to the last one
+    for (int j = starting_point; j < end; j++) {
+        fprintf(out, "%d: %s\n", j, history.lines[j % history.capacity]);
     }
 }
 
-// Stores the given word/arguments into the .msh_history file
+// Stores the given word/arguments into the history, queueing the line for
+// the .msh_history file
 static void store_command(char **words) {
-    char path[MAX_LINE_CHARS];
-    strcpy(path, getenv("HOME"));
-    strcat(path, "/.msh_history");
+    history_load();
 
-    // file pointer to file in append mode, or creates it if it doesn't exist
-    FILE *fp = fopen(path, "a+");
-    if (fp == NULL) {
-        perror("msh_history");
-        return;
+    // join the words with single spaces, followed by a newline
+    size_t length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        length += strlen(words[i]) + 1;
+    }
+    if (history.pending_length + length + 1 > history.pending_size) {
+        history.pending_size = 2 * (history.pending_length + length + 1);
+        history.pending = realloc(history.pending, history.pending_size);
+        assert(history.pending != NULL);
     }
-    // loops through words and store each string
+    char *line = history.pending + history.pending_length;
+    char *end = line;
     for (int i = 0; words[i] != NULL; i++) {
-        fprintf(fp, "%s", words[i]);
-        if (words[i + 1] != NULL) {
-            fprintf(fp, " ");
+        if (i > 0) {
+            *end++ = ' ';
         }
+        end = stpcpy(end, words[i]);
     }
-    // new line at end
-    fprintf(fp, "\n");
+    history_append(line, end - line);
 
-    fclose(fp);
+    if (!options[OPTION_HISTORY].value) {
+        // history file disabled
+        return;
+    }
+    if (!history.opened) {
+        history_open();
+    }
+    if (history.fd == -1) {
+        // history file unavailable
+        return;
+    }
+    *end++ = '\n';
+    history.pending_length = end - history.pending;
+    history.pending_count++;
+    long flush_every = options[OPTION_HISTFLUSH].value;
+    if (flush_every > 0 && history.pending_count >= flush_every) {
+        history_flush();
+    }
+}
+
+// Writes the queued lines to the history file
+static void history_flush(void) {
+    size_t written = 0;
+    while (history.fd != -1 && written < history.pending_length) {
+        ssize_t n = write(history.fd, history.pending + written,
+                          history.pending_length - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("msh_history");
+            break;
+        }
+        written += n;
+    }
+    history.pending_length = 0;
+    history.pending_count = 0;
 }
 
 // Given the number after ! call, return the line of command
+// The line belongs to the history and is replaced once enough commands are
+// stored after it
 static char *load_command(int command_num) {
-    char path[MAX_LINE_CHARS];
-    strcpy(path, getenv("HOME"));
-    strcat(path, "/.msh_history");
-
-    // file pointer to the history file in read mode
-    FILE *fp = fopen(path, "r");
-    if (fp == NULL) {
-        perror("msh_history");
-        return NULL;
-    }
-    // Store all the values of the file into an array
-    char data[1000][MAX_LINE_CHARS];
-    int i = 0;
-    while (fgets(data[i], MAX_LINE_CHARS, fp) != NULL) {
-        i++;
-    }
-    fclose(fp);
+    history_load();
 
-    int max_history = i - 1;
-    char *word = NULL;
+    int max_history = history.first + history.count - 1;
     if (command_num == -1) {
         // last command by default
-        word = data[max_history];
-    } else if (command_num > max_history) {
-        // value too big
+        command_num = max_history;
+    }
+    if (command_num > max_history || command_num < history.first) {
+        // value too big, or too old to still be remembered
         fprintf(stderr, "!: invalid history reference\n");
         return NULL;
-    } else {
-        // valid range
-        word = data[command_num];
     }
-    return word;
+    // valid range
+    return history.lines[command_num % history.capacity];
 }
 
-// Goes through words and checks if there are any special symbols for glob
-// Returns new expanded string of arguments for words
-static char *check_glob(char **words) {
+// Goes through words and checks if there are any special symbols for glob,
+// which `tokenize' has already marked in needs_glob
+// Returns new words with each pattern replaced by the files it matches, in
+// place, or NULL if there were no patterns
+// matched is set to say which of the new words came from a pattern
+static char **check_glob(char **words, bool *needs_glob, bool **matched) {
+    int count = 0;
     int symbol_count = 0;
-    // store the instances of a word with special symbols in an array
-    int word_num[100] = {};
-
-    for (int i = 0; words[i] != NULL; i++) {
-        int count_once = 1;
-        for (int j = 0; words[i][j] != '\0'; j++) {
-            if ((words[i][j] == '*' || words[i][j] == '?' ||
-                 words[i][j] == '[' || words[i][j] == '~') &&
-                count_once == 1) {
-                word_num[symbol_count] = i;
-                count_once = 0;
-                symbol_count++;
-            }
+    for (; words[count] != NULL; count++) {
+        if (needs_glob[count]) {
+            symbol_count++;
         }
     }
     if (symbol_count == 0) {
@@ -548,544 +1880,5209 @@ static char *check_glob(char **words) {
         return NULL;
     }
 
-    glob_t matches;
-    // call glob to search for expanded files
-    matches.gl_offs = symbol_count;
-    for (int i = 0; word_num[i] != '\0'; i++) {
-        if (i == 0) {
-            // first glob call
-            glob(words[word_num[i]], GLOB_NOCHECK | GLOB_TILDE, NULL, &matches);
-        } else {
-            // only append if it is after first glob call
-            glob(words[word_num[i]], GLOB_NOCHECK | GLOB_TILDE | GLOB_APPEND,
-                 NULL, &matches);
+    // expand every pattern into the same list, remembering where each
+    // one's matches end
+    glob_cache_refresh();
+    glob_matches.count = 0;
+    size_t *ends = arena_alloc(&command_arena, count * sizeof *ends);
+    for (int i = 0; i < count; i++) {
+        if (needs_glob[i]) {
+            glob_pattern(words[i]);
+            ends[i] = glob_matches.count;
         }
     }
-    // store the new arguments
-    char new[MAX_LINE_CHARS];
-    strcpy(new, words[0]);
-    strcat(new, " ");
-    for (int i = 0; i < matches.gl_pathc; i++) {
-        strcat(new, matches.gl_pathv[i]);
-        if (i + 1 != matches.gl_pathc) {
-            strcat(new, " ");
+
+    // splice the matches into the words, keeping every other word where
+    // it was
+    size_t new_count = count - symbol_count + glob_matches.count;
+    char **new = arena_alloc(&command_arena, (new_count + 1) * sizeof *new);
+    *matched = arena_alloc(&command_arena, (new_count + 1) * sizeof **matched);
+    size_t j = 0;
+    size_t match = 0;
+    for (int i = 0; i < count; i++) {
+        if (!needs_glob[i]) {
+            (*matched)[j] = false;
+            new[j++] = words[i];
+            continue;
         }
+        size_t n = ends[i] - match;
+        memcpy(new + j, glob_matches.paths + match, n * sizeof *new);
+        memset(*matched + j, true, n * sizeof **matched);
+        j += n;
+        match = ends[i];
     }
-    strcat(new, "\n");
-    char *word = new;
-    return word;
+    new[j] = NULL;
+    (*matched)[j] = false;
+    return new;
 }
 
-// Goes through words and checks validity of user inputs for '>', '<', and '|'
-static int redirection_check_arg(int count, int *input, int *output,
-                                 int *pipe_count, char **words) {
-    // MINIMUM 3 arguments required for <, >, or | functions
-    int input_err = 0, output_err = 0, pipe_err = 0;
-    for (int i = 0; i < count; i++) {
-        // if '<'
-        if (strcmp(words[i], "<") == 0) {
-            if (count < 3) {
-                input_err++;
-                break;
-            }
-            // can only be first argument
-            if (i == 0) {
-                // valid '<'
-                *input += 1;
-            } else {
-                // invalid '<'
-                input_err++;
-                break;
+// Sorts matches into the same order glob(3) gives them
+static int compare_matches(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//
+// Add the pathnames matching `pattern' to `glob_matches', sorted, or
+// `pattern' itself if nothing matches.  A leading `~' or `~user' is
+// replaced by that home directory first.  The pathnames are allocated
+// from the command arena.
+//
+static void glob_pattern(char *pattern) {
+    char *expanded = pattern;
+    if (pattern[0] == '~') {
+        size_t user_length = strcspn(pattern + 1, "/");
+        char *home = NULL;
+        if (user_length == 0) {
+            home = getenv("HOME");
+            if (home == NULL) {
+                struct passwd *pw = getpwuid(getuid());
+                home = pw != NULL ? pw->pw_dir : NULL;
             }
+        } else {
+            char *user = arena_alloc(&command_arena, user_length + 1);
+            memcpy(user, pattern + 1, user_length);
+            user[user_length] = '\0';
+            struct passwd *pw = getpwnam(user);
+            home = pw != NULL ? pw->pw_dir : NULL;
         }
-        // if '>'
-        if (strcmp(words[i], ">") == 0) {
-            if (count < 3) {
-                output_err++;
-            }
-            // can't be first
-            // can only be second last or third last from end
-            if (i == 0) {
-                output_err++;
-            } else if (i == count - 3) {
-                // third last from end, check if second last is also '>'
-                if (strcmp(words[i + 1], ">") == 0) {
-                    *output += 1;
-                } else {
-                    // second last is not '>', which is invalid
-                    output_err++;
-                }
-            } else if (i == count - 2) {
-                // second last from end
-                *output += 1;
-            } else {
-                // invalid '<'
-                output_err++;
-            }
-        }
-        // if '|'
-        if (strcmp(words[i], "|") == 0) {
-            if (count < 3) {
-                pipe_err++;
-            }
-            if (i == 0) {
-                // can't be first
-                pipe_err++;
-            } else if (i == count - 1) {
-                // can't be last
-                pipe_err++;
-            } else if (i > 0 && strcmp(words[i - 1], words[i]) == 0) {
-                // no 2 consecutive pipes
-                pipe_err++;
-            } else {
-                // valid
-                *pipe_count += 1;
-            }
+        if (home != NULL) {
+            char *rest = pattern + 1 + user_length;
+            expanded = arena_alloc(&command_arena,
+                                   strlen(home) + strlen(rest) + 1);
+            strcpy(stpcpy(expanded, home), rest);
         }
     }
-    // print errors if necessary
-    if (input_err) {
-        fprintf(stderr, "invalid input redirection\n");
-        return 1;
-    } else if (output_err) {
-        fprintf(stderr, "invalid output redirection\n");
-        return 1;
-    } else if (pipe_err) {
-        fprintf(stderr, "invalid pipe\n");
-        return 1;
-    }
 
-    return 0;
+    size_t first = glob_matches.count;
+    // an absolute pattern starts from the slashes at its front
+    size_t slashes = strspn(expanded, "/");
+    char *dir = arena_alloc(&command_arena, slashes + 1);
+    memcpy(dir, expanded, slashes);
+    dir[slashes] = '\0';
+    glob_walk(dir, expanded + slashes);
+
+    if (glob_matches.count == first) {
+        glob_add_match(pattern);
+    } else if (options[OPTION_GLOBSORT].value) {
+        qsort(glob_matches.paths + first, glob_matches.count - first,
+              sizeof *glob_matches.paths, compare_matches);
+    }
 }
 
-// pass content from file to stdin and capture output from posix_spawn to write
-// to file
-static void in_out_redirection(int max, char *program, int input, int output,
-                               char **words, char **environment) {
-    // check if input file is readable when '<' is called
-    int mode;
-    if (input) {
-        struct stat s1;
-        if (stat(words[1], &s1) != 0) {
-            // file doesn't exist
-            perror(words[1]);
-            return;
-        }
-        mode = s1.st_mode;
-        if ((mode & S_IRUSR) == 0) {
-            // not readable
-            fprintf(stderr, "%s: Permission denied\n", words[1]);
+//
+// Match `rest' of a pattern against what is in `dir', the directory
+// matched so far (`""' for the current directory, otherwise ending in
+// `/'), one component at a time.
+//
+static void glob_walk(char *dir, char *rest) {
+    size_t component_length = strcspn(rest, "/");
+    size_t slashes = strspn(rest + component_length, "/");
+    char *next = rest + component_length + slashes;
+    bool last = *next == '\0';
+    // a trailing slash only matches directories, and is kept
+    bool want_dir = !last || slashes > 0;
+    size_t dir_length = strlen(dir);
+
+    if (component_length == 2 && rest[0] == '*' && rest[1] == '*') {
+        glob_walk_recursive(dir, next, slashes);
+        return;
+    }
+
+    struct glob_compiled *compiled = glob_compile(rest, component_length);
+    if (!compiled->magic) {
+        // no wildcards: take the component as it is, and only check that
+        // it exists once the whole pattern is used up
+        size_t length = dir_length + compiled->literal_length + slashes;
+        char *path = arena_alloc(&command_arena, length + 1);
+        char *end = stpcpy(stpcpy(path, dir), compiled->literal);
+        memcpy(end, rest + component_length, slashes);
+        end[slashes] = '\0';
+        if (!last) {
+            glob_walk(path, next);
             return;
         }
-    }
-    // check if output file is writable when '>' is called only if file exists
-    if (output) {
-        struct stat s2;
-        if (stat(words[max - 1], &s2) == 0) {
-            // file exists
-            mode = s2.st_mode;
-            if ((mode & S_IWUSR) == 0) {
-                // not writable
-                fprintf(stderr, "%s: Permission denied\n", words[max - 1]);
-                return;
-            }
+        struct stat s;
+        if (stat(path, &s) == 0 ? (!want_dir || S_ISDIR(s.st_mode))
+                                : lstat(path, &s) == 0 && !want_dir) {
+            glob_add_match(path);
         }
+        return;
     }
 
-    // create actions
-    posix_spawn_file_actions_t actions;
-    if (posix_spawn_file_actions_init(&actions) != 0) {
-        perror("posix_spawn_file_actions_init");
+    struct dir_listing *listing = glob_list_dir(dir);
+    if (listing == NULL) {
         return;
     }
-
-    // if '<' called, get the input file, and replace stdin with file
-    if (input) {
-        const char *in = words[1];
-        if (posix_spawn_file_actions_addopen(&actions, 0, in, O_RDONLY, 0644) !=
-            0) {
-            perror("posix_spawn_file_actions_addopen");
-            return;
+    for (size_t i = 0; i < listing->count; i++) {
+        struct dir_entry *entry = &listing->entries[i];
+        char *name = listing->names + entry->name;
+        if (!glob_match(compiled, name, entry->length)) {
+            continue;
         }
-    }
-    // if '>' called, get name of output file and replace stdout with newly
-    // created file
-    if (output == 1) {
-        const char *out = words[max - 1];
-        if (posix_spawn_file_actions_addopen(&actions, 1, out,
-                                             O_CREAT | O_WRONLY, 0644) != 0) {
-            perror("posix_spawn_file_actions_addopen");
-            return;
+
+        size_t length = dir_length + entry->length + slashes;
+        char *path = arena_alloc(&command_arena, length + 1);
+        char *end = stpcpy(stpcpy(path, dir), name);
+        memcpy(end, rest + component_length, slashes);
+        end[slashes] = '\0';
+
+        if (want_dir) {
+            // only directories (or links to them) can be descended into
+            bool is_dir = entry->type == DT_DIR;
+            if (entry->type == DT_LNK || entry->type == DT_UNKNOWN) {
+                struct stat s;
+                is_dir = stat(path, &s) == 0 && S_ISDIR(s.st_mode);
+            }
+            if (!is_dir) {
+                continue;
+            }
         }
-    } else if (output == 2) {
-        // '>>' called, get name of output file and replace stdout with file in
-        // append mode
-        const char *out = words[max - 1];
-        if (posix_spawn_file_actions_addopen(
-                &actions, 1, out, O_CREAT | O_WRONLY | O_APPEND, 0644) != 0) {
-            perror("posix_spawn_file_actions_addopen");
-            return;
+        if (last) {
+            glob_add_match(path);
+        } else {
+            glob_walk(path, next);
         }
     }
+}
 
-    // get the correct arguments from words to pass to posix_spawn
-    char **arguments = calloc(max, sizeof *arguments);
-    char new[MAX_LINE_CHARS];
-    if (!input) {
-        // '>' called but not '<'
-        // only pass the arguments before '>' in words to posix_spawn
-        int i = 0;
-        while (strcmp(words[i], ">") != 0) {
-            strcpy(new, words[i]);
-            char *add = strdup(new);
-            assert(add != NULL);
-            arguments[i] = add;
-            i++;
+//
+// Expand a `**' component found in `dir'.  It matches `dir' and every
+// directory below it (except hidden ones, and without following symbolic
+// links), and `next' is matched in each of them.  The directories are
+// read in parallel by `glob_walk_thread'.
+//
+static void glob_walk_recursive(char *dir, char *next, size_t slashes) {
+    struct glob_walk *walk = &glob_walker;
+    memset(walk, 0, offsetof(struct glob_walk, workers));
+    atomic_store(&walk->pending, 0);
+    static bool initialised = false;
+    if (!initialised) {
+        for (int i = 0; i < GLOB_WALK_MAX_THREADS; i++) {
+            pthread_mutex_init(&walk->workers[i].lock, NULL);
         }
-        arguments[i] = NULL;
+        initialised = true;
+    }
+
+    // `**' by itself at the end matches everything below `dir', and
+    // `next' made of one component is matched while the directories are
+    // being read; anything longer is matched afterwards against each
+    // directory found
+    if (*next == '\0') {
+        walk->everything = true;
+        walk->want_dir = slashes > 0;
     } else {
-        if (!output) {
-            // '<' called but not '>'
-            // pass the arguments after '<' and the file name to posix_spawn.
-            // i.e. words[2] and after
-            int i = 2;
-            int j = 0;
-            while (words[i] != NULL) {
-                strcpy(new, words[i]);
-                char *add = strdup(new);
-                assert(add != NULL);
-                arguments[j] = add;
-                i++;
-                j++;
-            }
-            arguments[j] = NULL;
+        size_t component_length = strcspn(next, "/");
+        size_t next_slashes = strspn(next + component_length, "/");
+        if (next[component_length + next_slashes] == '\0') {
+            walk->compiled = glob_compile(next, component_length);
+            walk->want_dir = next_slashes > 0;
+            walk->suffix = next + component_length;
+            walk->suffix_length = next_slashes;
         } else {
-            // '<' and '>' called
-            // start with words[2], then go until '>' is reached
-            int i = 2;
-            int j = 0;
-            while (strcmp(words[i], ">") != 0) {
-                strcpy(new, words[i]);
-                char *add = strdup(new);
-                assert(add != NULL);
-                arguments[j] = add;
-                i++;
-                j++;
-            }
-            arguments[j] = NULL;
+            walk->collect_dirs = true;
         }
     }
 
-    // posix_spawn
-    pid_t pid;
-    if (posix_spawn(&pid, program, &actions, NULL, arguments, environment) !=
-        0) {
-        perror("spawn");
+    walk->root_fd = open(dir[0] == '\0' ? "." : dir,
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk->root_fd == -1) {
         return;
     }
+    walk->dir = dir;
 
-    // wait for program to finish
-    int exit_status;
-    if (waitpid(pid, &exit_status, 0) == -1) {
-        perror("waitpid");
-        return;
+    long n_workers = options[OPTION_GLOBTHREADS].value;
+    if (n_workers == OPTION_AUTO) {
+        n_workers = sysconf(_SC_NPROCESSORS_ONLN);
     }
-    if (WIFEXITED(exit_status)) {
-        printf("%s exit status = %d\n", program, WEXITSTATUS(exit_status));
+    if (n_workers < 1) {
+        n_workers = 1;
+    } else if (n_workers > GLOB_WALK_MAX_THREADS) {
+        n_workers = GLOB_WALK_MAX_THREADS;
+    }
+    walk->n_workers = n_workers;
+    for (int i = 0; i < n_workers; i++) {
+        struct glob_worker *worker = &walk->workers[i];
+        worker->walk = walk;
+        worker->n_found = 0;
+        worker->head = worker->tail = 0;
     }
 
-    // free the list of file actions
-    posix_spawn_file_actions_destroy(&actions);
-    // free arguments
-    free_tokens(arguments);
-}
-
-// get an array of all program paths needed for the pipes call, ending with NULL
-// e.g. if command called is "ls -l | cat | wc -l", this function will return
-// {"/bin/ls", "/bin/cat", "/usr/bin/wc", NULL}
-static char **get_programs(int max, char **words, int input, int output,
-                           char **path) {
-    char **programs = calloc(max + 1, sizeof *programs);
-    int i = 0;
-    if (input) {
-        // first program at words[2] if '<' called
-        i = 2;
-    }
-    int new = 1;
-    int j = 0;
-    while (i < max) {
-        if (strcmp(words[i], ">") == 0) {
-            // stop at '>'
+    // the first worker starts at `dir' itself, and the others steal
+    // from it
+    glob_walk_push(&walk->workers[0], "");
+    if (walk->collect_dirs) {
+        struct glob_worker *worker = &walk->workers[0];
+        worker->found_size = worker->found_size ? worker->found_size : 256;
+        worker->found = realloc(worker->found,
+                                worker->found_size * sizeof *worker->found);
+        assert(worker->found != NULL);
+        worker->found[worker->n_found++] = dir;
+    }
+    pthread_t threads[GLOB_WALK_MAX_THREADS];
+    int started = 1;
+    for (; started < n_workers; started++) {
+        if (pthread_create(&threads[started], NULL, glob_walk_thread,
+                           &walk->workers[started]) != 0) {
             break;
-        } else if (strcmp(words[i], "|") == 0) {
-            new = 1;
-            i++;
-            continue;
         }
+    }
+    glob_walk_thread(&walk->workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(walk->root_fd);
 
-        if (new) {
-            char *program = NULL;
-            char exe[MAX_LINE_CHARS];
-            strcpy(exe, words[i]);
-            // check the exe to see if builtin commands are called
-            if (strcmp(words[i], "pwd") == 0 || strcmp(words[i], "cd") == 0 ||
-                strcmp(words[i], "history") == 0 ||
-                strcmp(words[i], "!") == 0) {
-                // invalid as builtin command called
-                fprintf(
-                    stderr,
-                    "%s: I/O redirection not permitted for builtin commands\n",
-                    words[i]);
-                return NULL;
-            }
-            if (strrchr(exe, '/') == NULL) {
-                // if the program name has no '/'
-                // we need to find a valid path to the program
-                char pathname[MAX_LINE_CHARS];
-                for (int count = 0; path[count] != NULL; count++) {
-                    strcpy(pathname, path[count]);
-                    strcat(pathname, "/");
-                    strcat(pathname, exe);
-                    // loop through all the possible pathnames in $PATH
-                    if (is_executable(pathname)) {
-                        program = strdup(pathname);
-                        break;
-                    }
-                }
-            } else {
-                program = strdup(exe);
-            }
-            if (program == NULL) {
-                // invalid program
-                fprintf(stderr, "%s: command not found\n", exe);
-                return NULL;
+    // gather what every worker found
+    if (!walk->collect_dirs) {
+        for (int i = 0; i < n_workers; i++) {
+            struct glob_worker *worker = &walk->workers[i];
+            for (size_t j = 0; j < worker->n_found; j++) {
+                glob_add_match(worker->found[j]);
             }
-            programs[j] = program;
-            j++;
-            new = 0;
         }
-        i++;
+        return;
     }
-    programs[j] = NULL;
-    assert(programs != NULL);
-    return programs;
-}
 
-// get an array of arguments needed for one pipe call, ending with NULL
-// e.g. {"/bin/ls", "-l", NULL}
-static char **get_arguments(int max, char **words, int input, int output,
-                            int program_num) {
-    int i = 0;
-    if (input) {
-        // first program at words[2] if '<' called
-        i = 2;
+    // matching the rest may reach another `**', which starts a new walk
+    // over `glob_walker', so the directories are copied out first (the
+    // paths themselves stay in the workers' arenas until the command ends)
+    size_t n_dirs = 0;
+    for (int i = 0; i < n_workers; i++) {
+        n_dirs += walk->workers[i].n_found;
     }
-    int num = 0;
-    while (num < program_num) {
-        if (strcmp(words[i], "|") == 0) {
-            num += 1;
-        }
-        i++;
+    char **dirs = arena_alloc(&command_arena, n_dirs * sizeof *dirs);
+    n_dirs = 0;
+    for (int i = 0; i < n_workers; i++) {
+        struct glob_worker *worker = &walk->workers[i];
+        memcpy(dirs + n_dirs, worker->found,
+               worker->n_found * sizeof *dirs);
+        n_dirs += worker->n_found;
     }
-    // i has the index value of the program name in words
-    char **arguments = calloc(max, sizeof *arguments);
-    int j = 0;
-    while (i < max) {
-        if (strcmp(words[i], "|") == 0) {
-            break;
-        } else if (strcmp(words[i], ">") == 0) {
-            break;
-        }
-        char *new = strdup(words[i]);
-        assert(new != NULL);
-        arguments[j] = new;
-        i++;
-        j++;
+    for (size_t i = 0; i < n_dirs; i++) {
+        glob_walk(dirs[i], next);
     }
-    arguments[j] = NULL;
-    assert(arguments != NULL);
-    return arguments;
 }
 
-// runs pipes commands
-static void pipes(int max, char **programs, int input, int output,
-                  int pipe_count, char **words, char **environment) {
-    // check if input file is readable when '<' is called
-    int mode;
-    if (input) {
-        struct stat s1;
-        if (stat(words[1], &s1) != 0) {
-            // file doesn't exist
-            perror(words[1]);
-            return;
+//
+// The body of each thread walking the tree: take a directory from our own
+// queue, or steal the oldest one from another worker's, until there are
+// none left anywhere.
+//
+static void *glob_walk_thread(void *arg) {
+    struct glob_worker *worker = arg;
+    struct glob_walk *walk = worker->walk;
+    int idle = 0;
+    while (1) {
+        char *path = glob_walk_pop(worker, false);
+        for (int i = 1; path == NULL && i < walk->n_workers; i++) {
+            int victim = (worker - walk->workers + i) % walk->n_workers;
+            path = glob_walk_pop(&walk->workers[victim], true);
         }
-        mode = s1.st_mode;
-        if ((mode & S_IRUSR) == 0) {
-            // not readable
-            fprintf(stderr, "%s: Permission denied\n", words[1]);
-            return;
+        if (path != NULL) {
+            glob_walk_dir(worker, path);
+            // children were queued before this, so reaching zero means
+            // the walk is over
+            atomic_fetch_sub(&walk->pending, 1);
+            idle = 0;
+            continue;
         }
-    }
-    // check if output file is writable when '>' is called only if file exists
-    if (output) {
-        struct stat s2;
-        if (stat(words[max - 1], &s2) == 0) {
-            // file exists
-            mode = s2.st_mode;
-            if ((mode & S_IWUSR) == 0) {
-                // not writable
-                fprintf(stderr, "%s: Permission denied\n", words[max - 1]);
-                return;
-            }
+        if (atomic_load(&walk->pending) == 0) {
+            return NULL;
         }
-    }
-
-    // create number of pipes depending on number of pipes called
-    int pipe_file_descriptors[2 * pipe_count];
-    for (int i = 0; i < pipe_count; i++) {
-        if (pipe(pipe_file_descriptors + 2 * i) == -1) {
-            perror("pipe");
-            return;
+        // someone is still reading a directory that may add more
+        if (++idle < 64) {
+            sched_yield();
+        } else {
+            nanosleep(&(struct timespec){.tv_nsec = 50000}, NULL);
         }
     }
+}
 
-    // number of programs is number of pipes + 1
-    int program = pipe_count + 1;
-    // current_pipe tracks which pipe we are on, it goes up by 2 every time
-    int current_pipe = 0;
-    int i = 0;
-    while (program > 0) {
-        posix_spawn_file_actions_t actions;
-        if (posix_spawn_file_actions_init(&actions) != 0) {
-            perror("posix_spawn_file_actions_init");
-            return;
-        }
-        char **arguments = get_arguments(max, words, input, output, i);
-
-        if (program == pipe_count + 1) {
-            // first program
-            if (input) {
-                // '<' called
-                // replace stdin with the file
-                const char *in = words[1];
-                if (posix_spawn_file_actions_addopen(&actions, 0, in, O_RDONLY,
-                                                     0644) != 0) {
-                    perror("posix_spawn_file_actions_addopen");
-                    return;
-                }
-            }
-            // replace stdout with write end of current pipe
-            if (posix_spawn_file_actions_adddup2(
-                    &actions, pipe_file_descriptors[current_pipe + 1], 1) !=
-                0) {
-                perror("posix_spawn_file_actions_adddup2");
-                return;
-            }
+// Reads one directory (`path' below the walk's root) and queues the
+// directories in it
+static void glob_walk_dir(struct glob_worker *worker, char *path) {
+    struct glob_walk *walk = worker->walk;
+    int fd = path[0] == '\0'
+                 ? dup(walk->root_fd)
+                 : openat(walk->root_fd, path,
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    size_t path_length = strlen(path);
 
-            pid_t pid;
-            if (posix_spawn(&pid, programs[i], &actions, NULL, arguments,
-                            environment) != 0) {
-                perror("spawn");
-                return;
+    ssize_t n;
+    while ((n = getdents64(fd, worker->buffer, sizeof worker->buffer)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *d = (struct dirent64 *)(worker->buffer + offset);
+            offset += d->d_reclen;
+            char *name = d->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
             }
-            // close write end of current pipe
-            close(pipe_file_descriptors[current_pipe + 1]);
+            size_t length = strlen(name);
 
-            int exit_status;
-            if (waitpid(pid, &exit_status, 0) == -1) {
-                perror("waitpid");
-                return;
+            bool is_dir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat s;
+                is_dir = fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) == 0 &&
+                         S_ISDIR(s.st_mode);
             }
+            bool hidden = name[0] == '.';
 
-        } else if (program == 1) {
-            // last program
-            // replace stdin with read end of the previous pipe
-            if (posix_spawn_file_actions_adddup2(
-                    &actions, pipe_file_descriptors[current_pipe - 2], 0) !=
-                0) {
-                perror("posix_spawn_file_actions_adddup2");
-                return;
-            }
-            if (output == 1) {
-                // '>' called, get name of output file and replace stdout with
-                // newly created file
-                const char *out = words[max - 1];
-                if (posix_spawn_file_actions_addopen(
-                        &actions, 1, out, O_CREAT | O_WRONLY, 0644) != 0) {
-                    perror("posix_spawn_file_actions_addopen");
-                    return;
+            if (walk->compiled != NULL &&
+                glob_match(walk->compiled, name, length)) {
+                // a link to a directory matches `dir/', but isn't walked
+                bool matches = !walk->want_dir || is_dir;
+                if (!matches && d->d_type == DT_LNK) {
+                    struct stat s;
+                    matches = fstatat(fd, name, &s, 0) == 0 &&
+                              S_ISDIR(s.st_mode);
                 }
-            } else if (output == 2) {
-                // '>>' called, get name of output file and replace stdout with
-                // file in append mode
-                const char *out = words[max - 1];
-                if (posix_spawn_file_actions_addopen(
-                        &actions, 1, out, O_CREAT | O_WRONLY | O_APPEND,
-                        0644) != 0) {
-                    perror("posix_spawn_file_actions_addopen");
-                    return;
+                if (matches) {
+                    glob_walk_found(worker, path, path_length, name, length);
                 }
+            } else if (walk->everything && !hidden &&
+                       (!walk->want_dir || is_dir)) {
+                glob_walk_found(worker, path, path_length, name, length);
             }
 
-            pid_t pid;
-            if (posix_spawn(&pid, programs[i], &actions, NULL, arguments,
-                            environment) != 0) {
-                perror("spawn");
-                return;
-            }
-
-            int exit_status;
-            if (waitpid(pid, &exit_status, 0) == -1) {
-                perror("waitpid");
-                return;
+            if (is_dir && !hidden) {
+                char *child = glob_walk_join(worker, path, path_length, name,
+                                             length, "", 0);
+                if (walk->collect_dirs) {
+                    glob_walk_found(worker, path, path_length, name, length);
+                }
+                glob_walk_push(worker, child);
             }
+        }
+    }
+    close(fd);
+}
 
-            if (WIFEXITED(exit_status)) {
-                printf("%s exit status = %d\n", programs[i],
-                       WEXITSTATUS(exit_status));
-            }
+// Returns `path/name' followed by `suffix', from the worker's arena
+static char *glob_walk_join(struct glob_worker *worker, char *path,
+                            size_t path_length, char *name, size_t length,
+                            char *suffix, size_t suffix_length) {
+    char *joined = arena_alloc(&worker->arena,
+                               path_length + length + suffix_length + 2);
+    char *end = joined;
+    if (path_length > 0) {
+        memcpy(end, path, path_length);
+        end += path_length;
+        *end++ = '/';
+    }
+    memcpy(end, name, length);
+    end += length;
+    memcpy(end, suffix, suffix_length);
+    end[suffix_length] = '\0';
+    return joined;
+}
 
-        } else {
-            // middle programs
-            // replace stdin with read end of the previous pipe
-            if (posix_spawn_file_actions_adddup2(
-                    &actions, pipe_file_descriptors[current_pipe - 2], 0) !=
-                0) {
-                perror("posix_spawn_file_actions_adddup2");
-                return;
-            }
+// Records a match: `name' in the directory `path' below the walk's root
+static void glob_walk_found(struct glob_worker *worker, char *path,
+                            size_t path_length, char *name, size_t length) {
+    struct glob_walk *walk = worker->walk;
+    char *suffix = "";
+    size_t suffix_length = 0;
+    if (walk->collect_dirs) {
+        suffix = "/";
+        suffix_length = 1;
+    } else if (walk->compiled != NULL) {
+        suffix = walk->suffix;
+        suffix_length = walk->suffix_length;
+    } else if (walk->want_dir) {
+        suffix = "/";
+        suffix_length = 1;
+    }
 
-            // replace stdout with write end of pipe
-            if (posix_spawn_file_actions_adddup2(
-                    &actions, pipe_file_descriptors[current_pipe + 1], 1) !=
-                0) {
-                perror("posix_spawn_file_actions_adddup2");
-                return;
-            }
+    // prefix the directory the pattern started in
+    size_t dir_length = strlen(walk->dir);
+    char *relative = glob_walk_join(worker, path, path_length, name, length,
+                                    suffix, suffix_length);
+    char *found = arena_alloc(&worker->arena,
+                              dir_length + strlen(relative) + 1);
+    strcpy(stpcpy(found, walk->dir), relative);
 
-            pid_t pid;
-            if (posix_spawn(&pid, programs[i], &actions, NULL, arguments,
-                            environment) != 0) {
-                perror("spawn");
-                return;
-            }
-            // close write end of current pipe
-            close(pipe_file_descriptors[current_pipe + 1]);
+    if (worker->n_found == worker->found_size) {
+        worker->found_size = worker->found_size ? 2 * worker->found_size : 256;
+        worker->found = realloc(worker->found,
+                                worker->found_size * sizeof *worker->found);
+        assert(worker->found != NULL);
+    }
+    worker->found[worker->n_found++] = found;
+}
 
-            int exit_status;
-            if (waitpid(pid, &exit_status, 0) == -1) {
-                perror("waitpid");
-                return;
+// Queues a directory on a worker's own queue
+static void glob_walk_push(struct glob_worker *worker, char *path) {
+    atomic_fetch_add(&worker->walk->pending, 1);
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == worker->size) {
+        // slide what's left to the front before growing
+        memmove(worker->queue, worker->queue + worker->head,
+                (worker->tail - worker->head) * sizeof *worker->queue);
+        worker->tail -= worker->head;
+        worker->head = 0;
+        if (worker->tail == worker->size) {
+            worker->size = worker->size ? 2 * worker->size : 256;
+            worker->queue = realloc(worker->queue,
+                                    worker->size * sizeof *worker->queue);
+            assert(worker->queue != NULL);
+        }
+    }
+    worker->queue[worker->tail++] = path;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Takes a directory from a worker's queue: the newest if it is the
+// worker's own, the oldest if it is being stolen
+static char *glob_walk_pop(struct glob_worker *worker, bool steal) {
+    char *path = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head < worker->tail) {
+        path = steal ? worker->queue[worker->head++]
+                     : worker->queue[--worker->tail];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return path;
+}
+
+// Adds one pathname to `glob_matches'
+static void glob_add_match(char *path) {
+    if (glob_matches.count == glob_matches.size) {
+        glob_matches.size = glob_matches.size ? 2 * glob_matches.size : 64;
+        glob_matches.paths =
+            realloc(glob_matches.paths,
+                    glob_matches.size * sizeof *glob_matches.paths);
+        assert(glob_matches.paths != NULL);
+    }
+    glob_matches.paths[glob_matches.count++] = path;
+}
+
+//
+// Compile the first `length' characters of `pattern', a single pathname
+// component, into a list of operations for `glob_match'.
+//
+// A component without wildcards is not magic, and just has `literal'
+// (the component with its backslashes removed).  Otherwise the literal
+// characters after the last `*' are kept as `suffix', so most names can
+// be turned down without running the matcher at all.
+//
+static struct glob_compiled *glob_compile(const char *pattern,
+                                          size_t length) {
+    struct glob_compiled *compiled =
+        arena_alloc(&command_arena, sizeof *compiled);
+    memset(compiled, 0, sizeof *compiled);
+    compiled->ops =
+        arena_alloc(&command_arena, (length + 1) * sizeof *compiled->ops);
+    compiled->literal = arena_alloc(&command_arena, length + 1);
+
+    size_t i = 0;
+    while (i < length) {
+        struct glob_op *op = &compiled->ops[compiled->n_ops];
+        char c = pattern[i];
+        if (c == '*') {
+            i++;
+            if (compiled->n_ops > 0 && op[-1].type == GLOB_OP_STAR) {
+                // `**' in one component is the same as `*'
+                continue;
+            }
+            op->type = GLOB_OP_STAR;
+            compiled->n_ops++;
+            compiled->magic = true;
+            continue;
+        }
+        if (c == '?') {
+            op->type = GLOB_OP_ANY;
+            compiled->n_ops++;
+            compiled->min_length++;
+            compiled->magic = true;
+            i++;
+            continue;
+        }
+        if (c == '[') {
+            size_t used = glob_compile_class(pattern + i, length - i, op);
+            if (used > 0) {
+                compiled->n_ops++;
+                compiled->min_length++;
+                compiled->magic = true;
+                i += used;
+                continue;
+            }
+            // no closing `]', so the `[' is just a character
+        }
+        if (c == '\\' && i + 1 < length) {
+            c = pattern[++i];
+        }
+        op->type = GLOB_OP_LITERAL;
+        op->c = c;
+        compiled->literal[compiled->literal_length++] = c;
+        compiled->n_ops++;
+        compiled->min_length++;
+        i++;
+    }
+    compiled->literal[compiled->literal_length] = '\0';
+
+    // the literal characters after the last `*' must end every match
+    size_t n = compiled->n_ops;
+    while (n > 0 && compiled->ops[n - 1].type == GLOB_OP_LITERAL) {
+        n--;
+    }
+    if (n > 0 && compiled->ops[n - 1].type == GLOB_OP_STAR) {
+        compiled->suffix_length = compiled->n_ops - n;
+        compiled->suffix = arena_alloc(&command_arena,
+                                       compiled->suffix_length + 1);
+        for (size_t k = 0; k < compiled->suffix_length; k++) {
+            compiled->suffix[k] = compiled->ops[n + k].c;
+        }
+    }
+    return compiled;
+}
+
+//
+// Compile the bracket expression at the start of `pattern' (e.g. `[a-z]',
+// `[!0-9]' or `[[:alpha:]_]') into `op'.  Returns how many characters it
+// used, or 0 if it has no closing `]'.
+//
+static size_t glob_compile_class(const char *pattern, size_t length,
+                                 struct glob_op *op) {
+    static const struct {
+        const char *name;
+        int (*is)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+        {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+        {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+        {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+
+    memset(op->set, 0, sizeof op->set);
+    op->type = GLOB_OP_CLASS;
+    size_t i = 1;
+    bool negate = false;
+    if (i < length && (pattern[i] == '!' || pattern[i] == '^')) {
+        negate = true;
+        i++;
+    }
+    size_t start = i;
+    while (i < length && (pattern[i] != ']' || i == start)) {
+        // a named class such as `[:digit:]'
+        if (pattern[i] == '[' && i + 1 < length && pattern[i + 1] == ':') {
+            const char *end = memchr(pattern + i + 2, ':', length - i - 2);
+            bool found = false;
+            if (end != NULL && end + 1 < pattern + length && end[1] == ']') {
+                size_t name_length = end - (pattern + i + 2);
+                for (size_t k = 0; k < sizeof classes / sizeof *classes; k++) {
+                    if (strlen(classes[k].name) == name_length &&
+                        strncmp(classes[k].name, pattern + i + 2,
+                                name_length) == 0) {
+                        for (int ch = 0; ch < 256; ch++) {
+                            if (classes[k].is(ch)) {
+                                op->set[ch / 64] |= 1ULL << (ch % 64);
+                            }
+                        }
+                        found = true;
+                    }
+                }
+            }
+            if (found) {
+                i = end + 2 - pattern;
+                continue;
+            }
+        }
+
+        unsigned char low = pattern[i];
+        if (low == '\\' && i + 1 < length) {
+            low = pattern[++i];
+        }
+        i++;
+        unsigned char high = low;
+        if (i + 1 < length && pattern[i] == '-' && pattern[i + 1] != ']') {
+            high = pattern[i + 1];
+            if (high == '\\' && i + 2 < length) {
+                high = pattern[++i + 1];
+            }
+            i += 2;
+        }
+        for (int ch = low; ch <= high; ch++) {
+            op->set[ch / 64] |= 1ULL << (ch % 64);
+        }
+    }
+    if (i >= length) {
+        return 0;
+    }
+    if (negate) {
+        for (int k = 0; k < 4; k++) {
+            op->set[k] = ~op->set[k];
+        }
+    }
+    // `/' is never part of a name
+    op->set['/' / 64] &= ~(1ULL << ('/' % 64));
+    return i + 1;
+}
+
+//
+// Whether `name' (of `length' characters) matches a compiled component.
+//
+static bool glob_match(struct glob_compiled *compiled, const char *name,
+                       size_t length) {
+    // a leading `.' has to be matched by a `.' in the pattern
+    if (name[0] == '.' && (compiled->n_ops == 0 ||
+                           compiled->ops[0].type != GLOB_OP_LITERAL ||
+                           compiled->ops[0].c != '.')) {
+        return false;
+    }
+    if (length < compiled->min_length) {
+        return false;
+    }
+    if (compiled->suffix != NULL &&
+        memcmp(name + length - compiled->suffix_length, compiled->suffix,
+               compiled->suffix_length) != 0) {
+        return false;
+    }
+
+    // walk the pattern, going back to just after the last `*' (and
+    // giving it one more character) whenever the rest fails to match
+    size_t op = 0;
+    size_t i = 0;
+    size_t star_op = 0;
+    size_t star_i = 0;
+    bool star = false;
+    while (i < length) {
+        if (op < compiled->n_ops) {
+            struct glob_op *o = &compiled->ops[op];
+            unsigned char c = name[i];
+            if (o->type == GLOB_OP_STAR) {
+                star = true;
+                star_op = ++op;
+                star_i = i;
+                continue;
+            }
+            if (o->type == GLOB_OP_ANY ||
+                (o->type == GLOB_OP_LITERAL && o->c == name[i]) ||
+                (o->type == GLOB_OP_CLASS &&
+                 ((o->set[c / 64] >> (c % 64)) & 1))) {
+                op++;
+                i++;
+                continue;
+            }
+        }
+        if (!star) {
+            return false;
+        }
+        op = star_op;
+        i = ++star_i;
+    }
+    while (op < compiled->n_ops && compiled->ops[op].type == GLOB_OP_STAR) {
+        op++;
+    }
+    return op == compiled->n_ops;
+}
+
+//
+// Return the entries of `dir' (`""' meaning the current
+// directory), reading it with getdents64(2) if it hasn't been read yet.
+// Returns NULL if it can't be read.
+//
+static struct dir_listing *glob_list_dir(char *dir) {
+    // listings are keyed by absolute path, so a cached one still
+    // applies after `cd'
+    char *key = dir;
+    if (dir[0] != '/') {
+        if (glob_cache.cwd == NULL) {
+            glob_cache.cwd = getcwd(NULL, 0);
+            if (glob_cache.cwd == NULL) {
+                return NULL;
+            }
+        }
+        key = arena_alloc(&command_arena,
+                          strlen(glob_cache.cwd) + strlen(dir) + 2);
+        char *end = stpcpy(key, glob_cache.cwd);
+        if (dir[0] != '\0') {
+            strcpy(stpcpy(end, "/"), dir);
+        }
+    }
+
+    unsigned long bucket = hash_string(key) % GLOB_CACHE_BUCKETS;
+    for (struct dir_listing *listing = glob_cache.buckets[bucket];
+         listing != NULL; listing = listing->next) {
+        if (strcmp(listing->path, key) == 0) {
+            return listing;
+        }
+    }
+
+    if (glob_cache.n_listings >= GLOB_CACHE_MAX_DIRS) {
+        glob_cache_clear();
+    }
+
+    // watch the directory before reading it, so a change made while it
+    // is being read isn't missed
+    int watch = -1;
+    if (glob_cache_persistent()) {
+        if (glob_cache.inotify_fd == -1) {
+            glob_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        if (glob_cache.inotify_fd != -1) {
+            watch = inotify_add_watch(glob_cache.inotify_fd, key,
+                                      IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                          IN_MOVED_TO | IN_DELETE_SELF |
+                                          IN_MOVE_SELF | IN_ONLYDIR);
+        }
+    }
+
+    int fd = open(dir[0] == '\0' ? "." : dir,
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        if (watch != -1) {
+            inotify_rm_watch(glob_cache.inotify_fd, watch);
+        }
+        return NULL;
+    }
+
+    struct dir_listing *listing = calloc(1, sizeof *listing);
+    assert(listing != NULL);
+    size_t names_size = 0;
+    size_t entries_size = 0;
+    size_t names_length = 0;
+    static char buffer[GETDENTS_BUFFER_SIZE];
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, sizeof buffer)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buffer + offset);
+            offset += d->d_reclen;
+            size_t length = strlen(d->d_name);
+            if (names_length + length + 1 > names_size) {
+                names_size = 2 * (names_length + length + 1);
+                listing->names = realloc(listing->names, names_size);
+                assert(listing->names != NULL);
+            }
+            if (listing->count == entries_size) {
+                entries_size = entries_size ? 2 * entries_size : 64;
+                listing->entries =
+                    realloc(listing->entries,
+                            entries_size * sizeof *listing->entries);
+                assert(listing->entries != NULL);
+            }
+            memcpy(listing->names + names_length, d->d_name, length + 1);
+            listing->entries[listing->count++] = (struct dir_entry){
+                .name = names_length,
+                .length = length,
+                .type = d->d_type,
+            };
+            names_length += length + 1;
+        }
+    }
+    close(fd);
+
+    listing->path = strdup(key);
+    assert(listing->path != NULL);
+    listing->watch = watch;
+    listing->next = glob_cache.buckets[bucket];
+    glob_cache.buckets[bucket] = listing;
+    glob_cache.n_listings++;
+    return listing;
+}
+
+// Whether listings are kept between commands: `globcache' is on, or it is
+// `auto' and the shell is interactive
+static bool glob_cache_persistent(void) {
+    long value = options[OPTION_GLOBCACHE].value;
+    return value == OPTION_AUTO ? glob_cache.interactive : value;
+}
+
+//
+// Drop the listings of every directory that has changed since it was
+// read, as reported by inotify.  Called before each command's patterns
+// are expanded.
+//
+static void glob_cache_refresh(void) {
+    if (glob_cache.inotify_fd == -1) {
+        return;
+    }
+    char buffer[GETDENTS_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(glob_cache.inotify_fd, buffer, sizeof buffer)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct inotify_event *event =
+                (struct inotify_event *)(buffer + offset);
+            offset += sizeof *event + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, so nothing can be trusted
+                glob_cache_clear();
+                return;
+            }
+            glob_cache_forget(event->wd);
+        }
+    }
+}
+
+// Frees every listing watched with `watch', and stops watching it.  -1
+// frees the listings that couldn't be watched.
+static void glob_cache_forget(int watch) {
+    bool found = false;
+    for (int b = 0; b < GLOB_CACHE_BUCKETS; b++) {
+        struct dir_listing **link = &glob_cache.buckets[b];
+        while (*link != NULL) {
+            struct dir_listing *listing = *link;
+            if (listing->watch == watch) {
+                *link = listing->next;
+                free_listing(listing);
+                glob_cache.n_listings--;
+                found = true;
+            } else {
+                link = &listing->next;
+            }
+        }
+    }
+    if (found && watch != -1) {
+        inotify_rm_watch(glob_cache.inotify_fd, watch);
+    }
+}
+
+//
+// Called when a command has finished: forget the working directory, and
+// the listings too unless they are being kept between commands.  A listing
+// without a watch (when inotify has run out of them, say) would never be
+// dropped when its directory changes, so it is only kept for the command
+// that read it.
+//
+static void glob_cache_end_command(void) {
+    free(glob_cache.cwd);
+    glob_cache.cwd = NULL;
+    for (int i = 0; i < GLOB_WALK_MAX_THREADS; i++) {
+        arena_reset(&glob_walker.workers[i].arena);
+    }
+    if (glob_cache.n_listings > 0 && !glob_cache_persistent()) {
+        glob_cache_clear();
+    } else if (glob_cache.n_listings > 0) {
+        glob_cache_forget(-1);
+    }
+}
+
+// Frees every listing, and closes the inotify descriptor along with all of
+// its watches
+static void glob_cache_clear(void) {
+    for (int b = 0; b < GLOB_CACHE_BUCKETS; b++) {
+        struct dir_listing *listing = glob_cache.buckets[b];
+        while (listing != NULL) {
+            struct dir_listing *next = listing->next;
+            free_listing(listing);
+            listing = next;
+        }
+        glob_cache.buckets[b] = NULL;
+    }
+    glob_cache.n_listings = 0;
+    if (glob_cache.inotify_fd != -1) {
+        close(glob_cache.inotify_fd);
+        glob_cache.inotify_fd = -1;
+    }
+}
+
+static void free_listing(struct dir_listing *listing) {
+    free(listing->path);
+    free(listing->names);
+    free(listing->entries);
+    free(listing);
+}
+
+//
+// Parse the words of a command line, `needs_glob' saying which of them
+// are patterns, into a pipeline in the command arena.
+//
+// Returns NULL, having printed why, if the line isn't valid.
+//
+// Examples:
+//     `< in sort -r > out' is one command running {"sort", "-r"}, reading
+//     in and writing out.
+//     `ls -l | wc -l >> count &' is two commands in the background, the
+//     second appending to count.
+//
+static struct pipeline *parse(char **words, bool *needs_glob) {
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+
+    struct pipeline *pipeline = arena_alloc(&command_arena, sizeof *pipeline);
+    *pipeline = (struct pipeline){.background = false};
+    // a trailing '&' runs the line in the background; anywhere else, it's
+    // an error found with the rest
+    if (count > 1 && strcmp(words[count - 1], "&") == 0) {
+        pipeline->background = true;
+        count--;
+    }
+
+    // each command takes up at least a word and the '|' after it, and
+    // each redirection two words
+    int most_commands = (count + 1) / 2 + 1;
+    struct parser parser = {
+        .words = words,
+        .needs_glob = needs_glob,
+        .count = count,
+        .argv = arena_alloc(&command_arena,
+                            (count + most_commands) * sizeof(char *)),
+        .argv_glob =
+            arena_alloc(&command_arena, (count + most_commands) * sizeof(bool)),
+        .redirects = arena_alloc(&command_arena,
+                                 (count / 2 + 1) * sizeof(struct redirect)),
+    };
+    pipeline->commands =
+        arena_alloc(&command_arena, most_commands * sizeof(struct command));
+    if (!parse_pipeline(&parser, pipeline)) {
+        return NULL;
+    }
+    return pipeline;
+}
+
+// pipeline := command {'|' command}
+static bool parse_pipeline(struct parser *parser, struct pipeline *pipeline) {
+    while (1) {
+        if (!parse_command(parser, &pipeline->commands[pipeline->count++])) {
+            return false;
+        }
+        if (parser->at == parser->count) {
+            return true;
+        }
+        // parse_command only stops early at a '|'
+        parser->at++;
+    }
+}
+
+// command := {word | redirection}, with at least one word
+static bool parse_command(struct parser *parser, struct command *command) {
+    *command = (struct command){
+        .argv = parser->argv,
+        .needs_glob = parser->argv_glob,
+        .redirects = parser->redirects,
+    };
+    while (parser->at < parser->count &&
+           strcmp(parser->words[parser->at], "|") != 0) {
+        char *word = parser->words[parser->at];
+        if (strcmp(word, "&") == 0) {
+            fprintf(stderr, "invalid background command\n");
+            return false;
+        }
+        if (strcmp(word, "<") == 0 || strcmp(word, ">") == 0) {
+            if (!parse_redirect(parser, command)) {
+                return false;
+            }
+            continue;
+        }
+        command->needs_glob[command->argc] = parser->needs_glob[parser->at];
+        command->argv[command->argc++] = word;
+        parser->at++;
+    }
+    command->argv[command->argc] = NULL;
+    command->needs_glob[command->argc] = false;
+    parser->argv += command->argc + 1;
+    parser->argv_glob += command->argc + 1;
+    parser->redirects += command->n_redirects;
+
+    if (command->argc == 0) {
+        if (command->n_redirects == 0) {
+            // nothing between two '|'s, or before or after one
+            fprintf(stderr, "invalid pipe\n");
+        } else if (command->redirects[0].fd == STDIN_FILENO) {
+            fprintf(stderr, "invalid input redirection\n");
+        } else {
+            fprintf(stderr, "invalid output redirection\n");
+        }
+        return false;
+    }
+
+    // `command NAME' runs the program NAME even when msh has a builtin
+    // or builtin utility of that name
+    if (strcmp(command->argv[0], "command") == 0) {
+        if (command->argc == 1) {
+            fprintf(stderr, "usage: command PROGRAM [ARGUMENT...]\n");
+            return false;
+        }
+        command->argv++;
+        command->needs_glob++;
+        command->argc--;
+        command->external = true;
+    }
+    return true;
+}
+
+// redirection := '<' word | '>' word | '>' '>' word
+static bool parse_redirect(struct parser *parser, struct command *command) {
+    bool input = strcmp(parser->words[parser->at++], "<") == 0;
+    struct redirect redirect = {
+        .fd = input ? STDIN_FILENO : STDOUT_FILENO,
+        .flags = input ? O_RDONLY : O_CREAT | O_WRONLY,
+    };
+    if (!input && parser->at < parser->count &&
+        strcmp(parser->words[parser->at], ">") == 0) {
+        redirect.flags |= O_APPEND;
+        parser->at++;
+    }
+    if (parser->at < parser->count) {
+        redirect.path = parser->words[parser->at];
+    }
+    if (redirect.path == NULL || is_operator(redirect.path) ||
+        redirect_find(command, redirect.fd) != NULL) {
+        fprintf(stderr, input ? "invalid input redirection\n"
+                              : "invalid output redirection\n");
+        return false;
+    }
+    parser->at++;
+    command->redirects[command->n_redirects++] = redirect;
+    return true;
+}
+
+// Whether word is one of the words `parse' gives a meaning to
+static bool is_operator(char *word) {
+    return strcmp(word, "<") == 0 || strcmp(word, ">") == 0 ||
+           strcmp(word, "|") == 0 || strcmp(word, "&") == 0;
+}
+
+// Returns the words of pipeline, as they would be typed, ending in NULL:
+// what `jobs' shows for it
+static char **pipeline_words(struct pipeline *pipeline) {
+    int count = 0;
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command *command = &pipeline->commands[i];
+        count += 1 + command->external + command->argc +
+                 2 * command->n_redirects;
+    }
+    char **words = arena_alloc(&command_arena, count * sizeof *words);
+    char **end = words;
+    for (int i = 0; i < pipeline->count; i++) {
+        struct command *command = &pipeline->commands[i];
+        if (i > 0) {
+            *end++ = "|";
+        }
+        if (command->external) {
+            *end++ = "command";
+        }
+        memcpy(end, command->argv, command->argc * sizeof *words);
+        end += command->argc;
+        for (int j = 0; j < command->n_redirects; j++) {
+            struct redirect *redirect = &command->redirects[j];
+            *end++ = redirect->fd == STDIN_FILENO ? "<"
+                     : redirect->flags & O_APPEND ? ">>"
+                                                  : ">";
+            *end++ = redirect->path;
+        }
+    }
+    *end = NULL;
+    return words;
+}
+
+// Returns command's redirection of fd, or NULL if it has none
+static struct redirect *redirect_find(struct command *command, int fd) {
+    for (int i = 0; i < command->n_redirects; i++) {
+        if (command->redirects[i].fd == fd) {
+            return &command->redirects[i];
+        }
+    }
+    return NULL;
+}
+
+// Checks that the file command reads is readable, and that the file it
+// writes is writable if it exists, printing why not if they aren't
+static bool redirect_check(struct command *command) {
+    for (int i = 0; i < command->n_redirects; i++) {
+        struct redirect *redirect = &command->redirects[i];
+        struct stat s;
+        if (redirect->fd == STDIN_FILENO) {
+            if (stat(redirect->path, &s) != 0) {
+                // file doesn't exist
+                perror(redirect->path);
+                return false;
+            }
+            if ((s.st_mode & S_IRUSR) == 0) {
+                // not readable
+                fprintf(stderr, "%s: Permission denied\n", redirect->path);
+                return false;
+            }
+        } else if (stat(redirect->path, &s) == 0 &&
+                   (s.st_mode & S_IWUSR) == 0) {
+            // exists, but not writable
+            fprintf(stderr, "%s: Permission denied\n", redirect->path);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds opening each file command redirects to actions
+static void redirect_actions(struct command *command,
+                             struct spawn_actions *actions) {
+    for (int i = 0; i < command->n_redirects; i++) {
+        struct redirect *redirect = &command->redirects[i];
+        spawn_add_open(actions, redirect->fd, redirect->path,
+                       redirect->flags);
+    }
+}
+
+// the number of bytes words[from] up to words[to - 1] take up in a new
+// program's arguments (or environment): each string and a pointer to it
+// to < 0 means up to the NULL at the end of words
+static size_t argument_size(char **words, int from, int to) {
+    size_t size = 0;
+    for (int i = from; to < 0 ? words[i] != NULL : i < to; i++) {
+        size += strlen(words[i]) + 1 + sizeof *words;
+    }
+    return size;
+}
+
+// runs a command whose arguments are too long for one posix_spawn
+// xargs-style: the glob matches in its arguments are split into batches
+// that fit, and the command runs once per batch with every other word
+// where it was, up to `argjobs' batches at a time
+// each batch's exit status is reported as part of job
+static void run_batches(char *program, struct command *command,
+                        char **environment, struct job *job) {
+    char **words = command->argv;
+    bool *matched = command->matched;
+    int max = command->argc;
+    struct redirect *output = redirect_find(command, STDOUT_FILENO);
+    long limit = sysconf(_SC_ARG_MAX) - ARG_HEADROOM -
+                 argument_size(environment, 0, -1);
+    // the words no pattern matched go in every batch
+    long fixed = sizeof *words;
+    int n_fixed = 0;
+    for (int k = 0; k < max; k++) {
+        if (!matched[k]) {
+            fixed += argument_size(words, k, k + 1);
+            n_fixed++;
+        }
+    }
+
+    long at_once = options[OPTION_ARGJOBS].value;
+    if (at_once == OPTION_AUTO) {
+        at_once = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (at_once < 1 || output != NULL) {
+        // batches writing to one file have to take turns
+        at_once = 1;
+    }
+    if (output != NULL && !(output->flags & O_APPEND)) {
+        // the later batches append to what the first wrote, so nothing
+        // from before may be left past its end
+        int fd = open(output->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    int batch = 0;
+    int i = 0;
+    while (i < max && !matched[i]) {
+        i++;
+    }
+    for (; i < max; batch++) {
+        // take as many matches as fit, but always at least one, skipping
+        // over the fixed words between them
+        long size = fixed;
+        int n_matches = 0;
+        int j = i;
+        do {
+            if (matched[j]) {
+                size += argument_size(words, j, j + 1);
+                n_matches++;
+            }
+            j++;
+        } while (j < max && (!matched[j] ||
+                             size + (long)argument_size(words, j, j + 1) <=
+                                 limit));
+
+        // the fixed words, with matches i up to j - 1 in among them
+        char **batch_words = arena_alloc(
+            &command_arena, (n_fixed + n_matches + 1) * sizeof *batch_words);
+        int n = 0;
+        for (int k = 0; k < max; k++) {
+            if (!matched[k] || (k >= i && k < j)) {
+                batch_words[n++] = words[k];
+            }
+        }
+        batch_words[n] = NULL;
+        i = j;
+
+        // with '>', the batches after the first add to what it wrote
+        struct redirect redirects[2];
+        memcpy(redirects, command->redirects,
+               command->n_redirects * sizeof *redirects);
+        struct command batch_command = *command;
+        batch_command.argv = batch_words;
+        batch_command.redirects = redirects;
+        if (batch > 0 && output != NULL) {
+            redirects[output - command->redirects].flags |= O_APPEND;
+        }
+        struct spawn_actions actions = {.count = 0};
+        redirect_actions(&batch_command, &actions);
+
+        // wait for a batch to finish if there are already enough running,
+        // or while the machine is too busy for another
+        job_wait(job, at_once - 1, NULL);
+        while (!admit(job->running, at_once)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            long nanoseconds =
+                deadline.tv_nsec + ADMIT_RECHECK_MS % 1000 * 1000000;
+            deadline.tv_sec +=
+                ADMIT_RECHECK_MS / 1000 + nanoseconds / 1000000000;
+            deadline.tv_nsec = nanoseconds % 1000000000;
+            job_wait(job, job->running - 1, &deadline);
+        }
+
+        pid_t pid;
+        int pidfd;
+        int err =
+            spawn(&pid, &pidfd, program, &actions, batch_words, environment);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", program, strerror(err));
+            break;
+        }
+        job_add(job, pid, pidfd, program);
+    }
+}
+
+// get the plan for each stage of the pipes call, one for each command
+// e.g. if command called is "ls -l | cat | wc -l", this function will return
+// stages running {"/bin/ls", "-l"}, the `cat' utility and {"/usr/bin/wc", "-l"}
+// builtins that print are run once every stage has been found, with their
+// output kept for the stage to write
+static struct stage *get_stages(struct pipeline *pipeline, char **path) {
+    struct stage *stages =
+        arena_alloc(&command_arena, pipeline->count * sizeof *stages);
+    for (int i = 0; i < pipeline->count; i++) {
+        struct stage *stage = &stages[i];
+        *stage = (struct stage){.program = NULL};
+        char **arguments = pipeline->commands[i].argv;
+        char *exe = arguments[0];
+        // `command NAME' runs the program NAME, never a builtin
+        bool external = pipeline->commands[i].external;
+        stage->arguments = arguments;
+
+        if (!external && (stage->utility = find_utility(arguments)) != NULL) {
+            continue;
+        }
+        if (!external && is_builtin(exe)) {
+            // only the ones that just print something make sense here
+            if (!is_printing_builtin(exe)) {
+                fprintf(stderr,
+                        "%s: builtin command cannot be part of a pipeline\n",
+                        exe);
+                return NULL;
+            }
+            continue;
+        }
+
+        if (strrchr(exe, '/') == NULL) {
+            // if the program name has no '/'
+            // the hash table finds a valid path to the program
+            char *pathname = hash_lookup(exe, path);
+            if (pathname != NULL) {
+                stage->program = arena_strdup(&command_arena, pathname);
+            }
+        } else if (is_executable(exe)) {
+            stage->program = exe;
+        }
+        if (stage->program == NULL) {
+            // invalid program
+            fprintf(stderr, "%s: command not found\n", exe);
+            return NULL;
+        }
+    }
+
+    // check the files every stage reads and writes before any of them
+    // starts
+    for (int i = 0; i < pipeline->count; i++) {
+        if (!redirect_check(&pipeline->commands[i])) {
+            return NULL;
+        }
+    }
+
+    // nothing is run, and no option or table changed, if any stage is
+    // invalid
+    for (int i = 0; i < pipeline->count; i++) {
+        struct stage *stage = &stages[i];
+        if (stage->program == NULL && stage->utility == NULL) {
+            FILE *out =
+                open_memstream(&stage->output, &stage->output_length);
+            assert(out != NULL);
+            stage->status = run_builtin(stage->arguments, out);
+            fclose(out);
+        }
+    }
+    return stages;
+}
+
+// runs pipes commands
+// every stage is started up front so they all run concurrently, programs as
+// processes and builtin utilities on threads, then the parent closes its
+// copies of the pipe ends and reaps all of them
+static void pipes(struct pipeline *pipeline, struct stage *stages,
+                  char **environment, struct job *job) {
+    // create number of pipes depending on number of pipes called
+    // O_CLOEXEC stops every other stage from inheriting these ends, so a
+    // reader sees EOF as soon as its own writer exits
+    int pipe_count = pipeline->count - 1;
+    int pipe_file_descriptors[2 * pipe_count];
+    for (int i = 0; i < pipe_count; i++) {
+        if (pipe2(pipe_file_descriptors + 2 * i, O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (int j = 0; j < 2 * i; j++) {
+                close(pipe_file_descriptors[j]);
+            }
+            for (int j = 0; j < pipeline->count; j++) {
+                free(stages[j].output);
+            }
+            return;
+        }
+        pipe_resize(pipe_file_descriptors[2 * i + 1],
+                    stages[i + 1].utility != NULL, pipe_count);
+    }
+    // anything msh has printed goes before what the threads write
+    fflush(stdout);
+
+    // number of programs is number of pipes + 1
+    int program_count = pipe_count + 1;
+    for (int i = 0; i < program_count; i++) {
+        struct stage *stage = &stages[i];
+        struct command *command = &pipeline->commands[i];
+        // a stage's own '<', '>' or '>>' takes the place of its pipe
+        struct spawn_actions actions = {.count = 0};
+        redirect_actions(command, &actions);
+        if (i > 0 && redirect_find(command, STDIN_FILENO) == NULL) {
+            // replace stdin with read end of the previous pipe
+            spawn_add_dup2(&actions, pipe_file_descriptors[2 * (i - 1)], 0);
+        }
+        if (i < program_count - 1 &&
+            redirect_find(command, STDOUT_FILENO) == NULL) {
+            // replace stdout with write end of current pipe
+            spawn_add_dup2(&actions, pipe_file_descriptors[2 * i + 1], 1);
+        }
+
+        if (stage->program == NULL) {
+            // a builtin utility or a builtin's output, on a thread with
+            // its own copies of the fds
+            int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+            bool opened[2] = {false, false};
+            for (int j = 0; j < actions.count; j++) {
+                struct spawn_action *action = &actions.list[j];
+                if (action->kind == SPAWN_DUP2) {
+                    fds[action->fd] = action->source;
+                    continue;
+                }
+                fds[action->fd] =
+                    open(action->path, action->flags | O_CLOEXEC, 0644);
+                opened[action->fd] = true;
+                if (fds[action->fd] == -1) {
+                    fprintf(stderr, "%s: %s\n", action->path, strerror(errno));
+                }
+            }
+            // the rest are shared with msh or the other stages
+            for (int j = 0; j < 2; j++) {
+                if (!opened[j]) {
+                    fds[j] = fcntl(fds[j], F_DUPFD_CLOEXEC, 3);
+                    if (fds[j] == -1) {
+                        perror("fcntl");
+                    }
+                }
+            }
+            if (fds[0] == -1 || fds[1] == -1) {
+                for (int j = 0; j < 2; j++) {
+                    if (fds[j] != -1) {
+                        close(fds[j]);
+                    }
+                }
+                break;
+            }
+            stage_start(job, stage, fds[0], fds[1]);
+            continue;
+        }
+
+        pid_t pid;
+        int pidfd;
+        int err = spawn(&pid, &pidfd, stage->program, &actions,
+                        stage->arguments, environment);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", stage->program, strerror(err));
+            break;
+        }
+        // only the last program's exit status is reported, so one that
+        // failed to start is never mistaken for it
+        job_add(job, pid, pidfd,
+                i == program_count - 1 ? stage->program : NULL);
+    }
+
+    // the children and threads hold their own copies now, so close every
+    // end in the parent, otherwise the readers never see EOF
+    for (int i = 0; i < 2 * pipe_count; i++) {
+        close(pipe_file_descriptors[i]);
+    }
+    for (int i = 0; i <= pipe_count; i++) {
+        free(stages[i].output);
+    }
+}
+
+// Gives the pipe fd, one of the n_pipes in a pipeline, the buffer size the
+// `pipesize' option asks for, no bigger than /proc/sys/fs/pipe-max-size.
+// With auto, the size depends on whether a builtin utility reads it (see
+// `PIPE_PROGRAM_SIZE').  If the kernel won't, as when the user's pipes
+// already use as much memory as they may, it keeps the size it has.
+static void pipe_resize(int fd, bool utility_reads, int n_pipes) {
+    static long max_size = 0;
+    static long budget = -1;
+    if (max_size == 0) {
+        // the limits before they could be changed
+        max_size = proc_long("/proc/sys/fs/pipe-max-size", 1024 * 1024);
+        budget = proc_long("/proc/sys/fs/pipe-user-pages-soft", 16384) *
+                 sysconf(_SC_PAGESIZE);
+    }
+    long size = options[OPTION_PIPESIZE].value;
+    if (size == OPTION_AUTO) {
+        size = utility_reads ? FILTER_BUFFER_SIZE : PIPE_PROGRAM_SIZE;
+        // 0 means there is no soft limit
+        long share = budget / PIPE_BUDGET_SHARE / n_pipes;
+        while (budget > 0 && size > share && size > 64 * 1024) {
+            size /= 2;
+        }
+    }
+    if (size == 0) {
+        return;
+    }
+    fcntl(fd, F_SETPIPE_SZ, size < max_size ? size : max_size);
+}
+
+// Returns the number in the /proc file at path, or fallback if it can't
+// be read
+static long proc_long(const char *path, long fallback) {
+    long value = fallback;
+    FILE *f = fopen(path, "re");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = fallback;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+// Starts stage on a thread of job's, reading in and writing out, which it
+// closes when it finishes
+static void stage_start(struct job *job, struct stage *stage, int in,
+                        int out) {
+    struct stage_thread *thread = calloc(1, sizeof *thread);
+    assert(thread != NULL);
+    thread->utility = stage->utility;
+    thread->in = in;
+    thread->out = out;
+
+    // copy what it needs, as the job may outlive the command
+    int count = 0;
+    size_t length = 0;
+    for (; stage->arguments[count] != NULL; count++) {
+        length += strlen(stage->arguments[count]) + 1;
+    }
+    thread->arguments = malloc((count + 1) * sizeof(char *) + length);
+    assert(thread->arguments != NULL);
+    char *end = (char *)(thread->arguments + count + 1);
+    for (int i = 0; i < count; i++) {
+        thread->arguments[i] = end;
+        end = stpcpy(end, stage->arguments[i]) + 1;
+    }
+    thread->arguments[count] = NULL;
+    thread->output = stage->output;
+    thread->output_length = stage->output_length;
+    thread->status = stage->status;
+    stage->output = NULL;
+
+    // with every signal blocked, a write to a closed pipe fails with EPIPE
+    // rather than killing msh
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread->thread, NULL, stage_thread_run, thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", thread->arguments[0], strerror(err));
+        stage_free(thread);
+        return;
+    }
+    job_add(job, 0, PIDFD_THREAD, NULL);
+    job->threads[job->count - 1] = thread;
+}
+
+// Runs a pipeline stage's utility, or writes out its builtin's output, then
+// tells the event loop it has finished
+static void *stage_thread_run(void *arg) {
+    struct stage_thread *thread = arg;
+    if (thread->utility != NULL) {
+        thread->status =
+            thread->utility->run(thread->arguments, thread->in, thread->out);
+    } else if (!write_all(thread->out, thread->output,
+                          thread->output_length) &&
+               errno != EPIPE) {
+        fprintf(stderr, "%s: write error: %s\n", thread->arguments[0],
+                strerror(errno));
+        thread->status = 1;
+    }
+    close(thread->in);
+    close(thread->out);
+    thread->in = thread->out = -1;
+    atomic_store(&thread->done, true);
+    uint64_t one = 1;
+    write(events.thread_fd, &one, sizeof one);
+    return NULL;
+}
+
+// Frees a stage's thread, once it has been joined or couldn't start
+static void stage_free(struct stage_thread *thread) {
+    if (thread->in != -1) {
+        close(thread->in);
+        close(thread->out);
+    }
+    free(thread->arguments);
+    free(thread->output);
+    free(thread);
+}
+
+// Adds opening path with flags as fd to actions
+static void spawn_add_open(struct spawn_actions *actions, int fd,
+                           const char *path, int flags) {
+    assert(actions->count < SPAWN_MAX_ACTIONS);
+    actions->list[actions->count++] = (struct spawn_action){
+        .kind = SPAWN_OPEN, .fd = fd, .path = path, .flags = flags};
+}
+
+// Adds duplicating source as fd to actions
+static void spawn_add_dup2(struct spawn_actions *actions, int source, int fd) {
+    assert(actions->count < SPAWN_MAX_ACTIONS);
+    actions->list[actions->count++] =
+        (struct spawn_action){.kind = SPAWN_DUP2, .fd = fd, .source = source};
+}
+
+//
+// Start the program at `path' with `arguments' and `environment', after
+// applying `actions' to its file descriptors.  The program gets only
+// standard input, output and error; every other fd is closed.
+//
+// Returns 0 and sets `pid', and `pidfd' to a pidfd for it or -1, or
+// returns an errno value if the program couldn't be started.
+//
+static int spawn(pid_t *pid, int *pidfd, char *path,
+                 struct spawn_actions *actions, char **arguments,
+                 char **environment) {
+    *pidfd = -1;
+    if (options[OPTION_ZYGOTE].value) {
+        if (zygote.pid == 0) {
+            // turned on since msh started
+            zygote_start();
+        }
+        if (zygote.fd != -1) {
+            int err = zygote_spawn(pid, path, actions, arguments, environment);
+            if (err == 0) {
+                *pidfd = PIDFD_ZYGOTE;
+            }
+            if (err != EMSGSIZE && err != EPIPE) {
+                return err;
+            }
+            // too big for the zygote, or it's gone
+        }
+    }
+    return spawn_direct(pid, pidfd, path, actions, arguments, environment);
+}
+
+//
+// Start a program as `spawn' does, but always as msh's own child, with
+// clone(2) or posix_spawn and never through the zygote, so that it can be
+// waited for with waitpid(2).  Safe to call from any thread.
+//
+static int spawn_direct(pid_t *pid, int *pidfd, char *path,
+                        struct spawn_actions *actions, char **arguments,
+                        char **environment) {
+    *pidfd = -1;
+    if (options[OPTION_FASTSPAWN].value && atomic_load(&spawn_fast_works)) {
+        struct spawn_request request = {
+            .path = path,
+            .actions = actions,
+            .arguments = arguments,
+            .environment = environment,
+        };
+        // the child only needs a little stack until it execs, and a
+        // caller's own is never shared with another spawn
+        char stack[SPAWN_STACK_SIZE] __attribute__((aligned(16)));
+        // the child shares our memory, so no signal handler may run in
+        // it before exec; it unblocks them itself
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        *pid = clone(spawn_child, stack + sizeof stack,
+                     CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &request,
+                     pidfd);
+        int err = errno;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (*pid != -1) {
+            if (request.error == 0) {
+                return 0;
+            }
+            // it got as far as running, so it has to be reaped
+            waitpid(*pid, NULL, 0);
+            close(*pidfd);
+            *pidfd = -1;
+            return request.error;
+        }
+        if (err != EINVAL && err != ENOSYS && err != EPERM) {
+            return err;
+        }
+        // this kernel can't, so use posix_spawn from now on
+        atomic_store(&spawn_fast_works, false);
+    }
+
+    posix_spawn_file_actions_t file_actions;
+    int err = posix_spawn_file_actions_init(&file_actions);
+    for (int i = 0; err == 0 && i < actions->count; i++) {
+        struct spawn_action *action = &actions->list[i];
+        if (action->kind == SPAWN_OPEN) {
+            err = posix_spawn_file_actions_addopen(
+                &file_actions, action->fd, action->path, action->flags, 0644);
+        } else {
+            err = posix_spawn_file_actions_adddup2(&file_actions,
+                                                   action->source, action->fd);
+        }
+    }
+    if (err == 0) {
+        err = posix_spawn_file_actions_addclosefrom_np(&file_actions, 3);
+    }
+    if (err == 0) {
+        err = posix_spawn(pid, path, &file_actions, &spawn_attributes,
+                          arguments, environment);
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    return err;
+}
+
+//
+// The child side of the fast spawn path.  It runs on a stack in our
+// memory while the thread that started it is suspended, until it execs
+// or exits, so it only makes system calls, and reports why it failed in
+// `request->error'.
+//
+static int spawn_child(void *arg) {
+    struct spawn_request *request = arg;
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    for (int i = 0; i < request->actions->count; i++) {
+        struct spawn_action *action = &request->actions->list[i];
+        if (action->kind == SPAWN_OPEN) {
+            int fd = open(action->path, action->flags, 0644);
+            if (fd == -1) {
+                goto fail;
+            }
+            if (fd != action->fd) {
+                if (dup2(fd, action->fd) == -1) {
+                    goto fail;
+                }
+                close(fd);
+            }
+        } else if (dup2(action->source, action->fd) == -1) {
+            goto fail;
+        }
+    }
+    // an old kernel without close_range leaves it to O_CLOEXEC
+    close_range(3, ~0U, 0);
+
+    execve(request->path, request->arguments, request->environment);
+fail:
+    request->error = errno;
+    _exit(127);
+}
+
+//
+// Start the zygote: a child of msh, forked while msh is still small, that
+// starts programs for us.  If it can't be started msh spawns programs
+// itself.
+//
+static void zygote_start(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("zygote: socketpair");
+        zygote.pid = -1;
+        return;
+    }
+    int size = ZYGOTE_MESSAGE_SIZE;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote: fork");
+        close(fds[0]);
+        close(fds[1]);
+        zygote.pid = -1;
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        zygote_main(fds[1]);
+    }
+    close(fds[1]);
+    zygote.pid = pid;
+    zygote.fd = fds[0];
+    zygote.buffer = malloc(ZYGOTE_MESSAGE_SIZE);
+    assert(zygote.buffer != NULL);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_ZYGOTE};
+    if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, zygote.fd, &event) == -1) {
+        perror("zygote: epoll_ctl");
+    }
+}
+
+//
+// The zygote itself: waits for requests to start programs, and for its
+// programs to exit, and never returns.  It exits when msh does.
+//
+static void zygote_main(int fd) {
+    // keep only the standard fds and the socket
+    if (fd > 3) {
+        close_range(3, fd - 1, 0);
+    }
+    close_range(fd + 1, ~0U, 0);
+
+    // SIGCHLD is already blocked, as it is in msh
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    int signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("zygote: signalfd");
+        _exit(1);
+    }
+
+    struct zygote_child *children = NULL;
+    int n_children = 0, children_size = 0;
+    char *buffer = malloc(ZYGOTE_MESSAGE_SIZE);
+    assert(buffer != NULL);
+    struct pollfd polls[2] = {{.fd = fd, .events = POLLIN},
+                              {.fd = signal_fd, .events = POLLIN}};
+    while (1) {
+        if (poll(polls, 2, -1) == -1) {
+            continue;
+        }
+
+        if (polls[1].revents) {
+            // report every program that has exited
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof info) > 0) {
+            }
+            int status;
+            struct rusage usage;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                int i = 0;
+                while (i < n_children && children[i].pid != pid) {
+                    i++;
+                }
+                if (i == n_children) {
+                    continue;
+                }
+                struct zygote_child *child = &children[i];
+                struct zygote_message *message = (void *)buffer;
+                *message = (struct zygote_message){
+                    .type = ZYGOTE_EXITED,
+                    .pid = pid,
+                    .status = status,
+                    .spawn_ns = child->spawn_ns,
+                    .run_ns = elapsed_ns(&child->started),
+                    .user_ns = usage.ru_utime.tv_sec * 1000000000L +
+                               usage.ru_utime.tv_usec * 1000L,
+                    .system_ns = usage.ru_stime.tv_sec * 1000000000L +
+                                 usage.ru_stime.tv_usec * 1000L,
+                };
+                char *end = stpcpy(buffer + sizeof *message, child->path) + 1;
+                send(fd, buffer, end - buffer, MSG_NOSIGNAL);
+                free(child->path);
+                children[i] = children[--n_children];
+            }
+        }
+
+        if (polls[0].revents) {
+            int fds[SPAWN_MAX_ACTIONS + 1];
+            int n_fds = 0;
+            ssize_t n = zygote_receive(fd, buffer, fds, &n_fds, 0);
+            if (n == 0) {
+                // msh has gone
+                _exit(0);
+            }
+            if (n < (ssize_t)sizeof(struct zygote_message)) {
+                for (int i = 0; i < n_fds; i++) {
+                    close(fds[i]);
+                }
+                continue;
+            }
+
+            if (n_children == children_size) {
+                children_size = children_size ? 2 * children_size : 16;
+                children = realloc(children, children_size * sizeof *children);
+                assert(children != NULL);
+            }
+            struct zygote_child *child = &children[n_children];
+            struct zygote_message reply = {.type = ZYGOTE_STARTED};
+            reply.error = zygote_fork(buffer, n, fds, n_fds, child);
+            for (int i = 0; i < n_fds; i++) {
+                close(fds[i]);
+            }
+            if (reply.error == 0) {
+                reply.pid = child->pid;
+                n_children++;
+            }
+            send(fd, &reply, sizeof reply, MSG_NOSIGNAL);
+        }
+    }
+}
+
+//
+// Start the program described by the ZYGOTE_SPAWN message in `buffer',
+// `length' bytes long, with the fds that came with it, and fill in `child'.
+//
+// Returns 0 once the program has been exec'ed, or why it couldn't be.
+//
+static int zygote_fork(char *buffer, ssize_t length, int *fds, int n_fds,
+                       struct zygote_child *child) {
+    struct zygote_message *message = (void *)buffer;
+    if (n_fds < 1 || message->n_actions > SPAWN_MAX_ACTIONS) {
+        return EINVAL;
+    }
+
+    // unpack the strings: the path, each file to open, the arguments and
+    // the environment
+    int n_opens = 0;
+    for (int i = 0; i < message->n_actions; i++) {
+        n_opens += message->actions[i].kind == SPAWN_OPEN;
+    }
+    int n_strings =
+        1 + n_opens + message->n_arguments + 1 + message->n_environment + 1;
+    char **strings = malloc(n_strings * sizeof *strings);
+    assert(strings != NULL);
+    char *s = buffer + sizeof *message;
+    char *end = buffer + length;
+    for (int i = 0; i < n_strings; i++) {
+        bool terminator =
+            i == n_strings - 1 || i == 1 + n_opens + message->n_arguments;
+        if (terminator) {
+            strings[i] = NULL;
+            continue;
+        }
+        if (s >= end) {
+            free(strings);
+            return EINVAL;
+        }
+        strings[i] = s;
+        s += strnlen(s, end - s) + 1;
+    }
+    char *path = strings[0];
+    char **arguments = strings + 1 + n_opens;
+    char **environment = arguments + message->n_arguments + 1;
+    for (int i = 0, opened = 0; i < message->n_actions; i++) {
+        struct spawn_action *action = &message->actions[i];
+        if (action->kind == SPAWN_OPEN) {
+            action->path = strings[1 + opened++];
+        } else if (action->source < 1 || action->source >= n_fds) {
+            free(strings);
+            return EINVAL;
+        } else {
+            action->source = fds[action->source];
+        }
+    }
+
+    // the program's exec closes its end of this, or it writes its errno
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        free(strings);
+        return errno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &child->started);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        // fds[0] is msh's current directory
+        int err = fchdir(fds[0]) == -1 ? errno : 0;
+        for (int i = 0; err == 0 && i < message->n_actions; i++) {
+            struct spawn_action *action = &message->actions[i];
+            int fd = action->source;
+            if (action->kind == SPAWN_OPEN) {
+                fd = open(action->path, action->flags, 0644);
+            }
+            if (fd == -1 || dup2(fd, action->fd) == -1) {
+                err = errno;
+            }
+        }
+        if (err == 0) {
+            // everything else goes at exec, including our end of the pipe
+            close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+            execve(path, arguments, environment);
+            err = errno;
+        }
+        write(status_pipe[1], &err, sizeof err);
+        _exit(127);
+    }
+    int err = pid == -1 ? errno : 0;
+    close(status_pipe[1]);
+    if (pid != -1 && read(status_pipe[0], &err, sizeof err) == sizeof err) {
+        waitpid(pid, NULL, 0);
+    } else {
+        err = pid == -1 ? err : 0;
+    }
+    close(status_pipe[0]);
+    if (err == 0) {
+        child->pid = pid;
+        child->spawn_ns = elapsed_ns(&child->started);
+        child->path = strdup(path);
+    }
+    free(strings);
+    return err;
+}
+
+// Receives a message from fd into buffer, along with any fds sent with it,
+// adding them to fds
+static ssize_t zygote_receive(int fd, char *buffer, int *fds, int *n_fds,
+                              int flags) {
+    union {
+        char space[CMSG_SPACE((SPAWN_MAX_ACTIONS + 1) * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = buffer, .iov_len = ZYGOTE_MESSAGE_SIZE};
+    struct msghdr header = {.msg_iov = &iov,
+                            .msg_iovlen = 1,
+                            .msg_control = control.space,
+                            .msg_controllen = sizeof control.space};
+    ssize_t n = recvmsg(fd, &header, flags | MSG_CMSG_CLOEXEC);
+    if (n == -1) {
+        return -1;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&header); c != NULL && fds != NULL;
+         c = CMSG_NXTHDR(&header, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds + *n_fds, CMSG_DATA(c), count * sizeof(int));
+            *n_fds += count;
+        }
+    }
+    return n;
+}
+
+//
+// Ask the zygote to start a program, as `spawn' would.
+//
+// Returns 0 and sets `pid', or an errno value: EMSGSIZE if the request
+// doesn't fit in a message, or EPIPE if the zygote has gone.
+//
+static int zygote_spawn(pid_t *pid, char *path, struct spawn_actions *actions,
+                        char **arguments, char **environment) {
+    struct zygote_message *message = (void *)zygote.buffer;
+    *message = (struct zygote_message){
+        .type = ZYGOTE_SPAWN,
+        .n_actions = actions->count,
+    };
+
+    // the current directory goes first, then whatever is duplicated
+    int fds[SPAWN_MAX_ACTIONS + 1];
+    int n_fds = 0;
+    fds[n_fds++] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[0] == -1) {
+        return errno;
+    }
+    char *end = zygote.buffer + ZYGOTE_MESSAGE_SIZE;
+    char *s = zygote_pack(zygote.buffer + sizeof *message, end, path);
+    for (int i = 0; i < actions->count; i++) {
+        message->actions[i] = actions->list[i];
+        message->actions[i].path = NULL;
+        if (actions->list[i].kind == SPAWN_OPEN) {
+            s = zygote_pack(s, end, actions->list[i].path);
+        } else {
+            message->actions[i].source = n_fds;
+            fds[n_fds++] = actions->list[i].source;
+        }
+    }
+    for (; arguments[message->n_arguments] != NULL; message->n_arguments++) {
+        s = zygote_pack(s, end, arguments[message->n_arguments]);
+    }
+    for (; environment[message->n_environment] != NULL;
+         message->n_environment++) {
+        s = zygote_pack(s, end, environment[message->n_environment]);
+    }
+    if (s == NULL) {
+        close(fds[0]);
+        return EMSGSIZE;
+    }
+
+    union {
+        char space[CMSG_SPACE((SPAWN_MAX_ACTIONS + 1) * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = zygote.buffer,
+                        .iov_len = s - zygote.buffer};
+    struct msghdr header = {.msg_iov = &iov,
+                            .msg_iovlen = 1,
+                            .msg_control = control.space,
+                            .msg_controllen = CMSG_SPACE(n_fds * sizeof(int))};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&header);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, n_fds * sizeof(int));
+    ssize_t sent = sendmsg(zygote.fd, &header, MSG_NOSIGNAL);
+    int err = errno;
+    close(fds[0]);
+    if (sent == -1) {
+        if (err != EMSGSIZE) {
+            zygote_lost();
+            return EPIPE;
+        }
+        return err;
+    }
+
+    // programs that exit meanwhile are reported before the reply
+    while (1) {
+        int no_fds = 0;
+        ssize_t n = zygote_receive(zygote.fd, zygote.buffer, NULL, &no_fds, 0);
+        if (n <= 0) {
+            zygote_lost();
+            return EPIPE;
+        }
+        message = (void *)zygote.buffer;
+        if (message->type == ZYGOTE_STARTED) {
+            *pid = message->pid;
+            return message->error;
+        }
+        zygote_exited(message, n);
+    }
+}
+
+// Copies s to the message being built at start, returning where the next
+// string goes, or NULL once it doesn't fit before end
+static char *zygote_pack(char *start, char *end, const char *s) {
+    if (start == NULL) {
+        return NULL;
+    }
+    size_t length = strlen(s) + 1;
+    if ((size_t)(end - start) < length) {
+        return NULL;
+    }
+    memcpy(start, s, length);
+    return start + length;
+}
+
+// Handles whatever the zygote has sent, without waiting
+static void zygote_read(void) {
+    while (zygote.fd != -1) {
+        int no_fds = 0;
+        ssize_t n = zygote_receive(zygote.fd, zygote.buffer, NULL, &no_fds,
+                                   MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            zygote_lost();
+            return;
+        }
+        zygote_exited((void *)zygote.buffer, n);
+    }
+}
+
+// Records that a program the zygote started has exited, `length' being the
+// size of `message'
+static void zygote_exited(struct zygote_message *message, ssize_t length) {
+    if (message->type != ZYGOTE_EXITED ||
+        length <= (ssize_t)sizeof *message) {
+        return;
+    }
+    for (int i = 0; i < jobs.count; i++) {
+        struct job *job = jobs.list[i];
+        for (int j = job->reported; j < job->count; j++) {
+            if (job->pidfds[j] == PIDFD_ZYGOTE && !job->reaped[j] &&
+                job->pids[j] == message->pid) {
+                job->statuses[j] = message->status;
+                job->reaped[j] = true;
+                job->running--;
+            }
+        }
+    }
+
+    // add to the program's statistics
+    char *path = (char *)(message + 1);
+    path[length - sizeof *message - 1] = '\0';
+    unsigned long bucket = hash_string(path) % ZYGOTE_STATS_BUCKETS;
+    struct zygote_stat *stat = zygote.stats[bucket];
+    while (stat != NULL && strcmp(stat->path, path) != 0) {
+        stat = stat->next;
+    }
+    if (stat == NULL) {
+        stat = calloc(1, sizeof *stat);
+        assert(stat != NULL);
+        stat->path = strdup(path);
+        stat->next = zygote.stats[bucket];
+        zygote.stats[bucket] = stat;
+        zygote.n_stats++;
+    }
+    stat->runs++;
+    stat->spawn_ns += message->spawn_ns;
+    stat->run_ns += message->run_ns;
+    stat->user_ns += message->user_ns;
+    stat->system_ns += message->system_ns;
+}
+
+// The zygote has gone: programs are spawned by msh from now on, and any
+// the zygote was still running can't be waited for
+static void zygote_lost(void) {
+    if (zygote.fd == -1) {
+        return;
+    }
+    fprintf(stderr, "zygote: exited, starting programs directly\n");
+    close(zygote.fd);
+    zygote.fd = -1;
+    waitpid(zygote.pid, NULL, 0);
+    zygote.pid = -1;
+    for (int i = 0; i < jobs.count; i++) {
+        struct job *job = jobs.list[i];
+        for (int j = job->reported; j < job->count; j++) {
+            if (job->pidfds[j] == PIDFD_ZYGOTE && !job->reaped[j]) {
+                // killed, as far as anyone can tell, so nothing is printed
+                job->statuses[j] = SIGKILL;
+                job->reaped[j] = true;
+                job->running--;
+            }
+        }
+    }
+}
+
+// Nanoseconds since start
+static long elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L +
+           (now.tv_nsec - start->tv_nsec);
+}
+
+// Orders statistics by the most time spent running first
+static int compare_stats(const void *a, const void *b) {
+    const struct zygote_stat *x = *(struct zygote_stat *const *)a;
+    const struct zygote_stat *y = *(struct zygote_stat *const *)b;
+    return (x->run_ns < y->run_ns) - (x->run_ns > y->run_ns);
+}
+
+//
+// Implement the `zygote' shell built-in, which shows how many times each
+// program has been started by the zygote, how long starting it took on
+// average, and the total time it ran and spent on the CPU.
+//
+// Synopsis:
+//     zygote [-r]
+//
+// With `-r', forgets the statistics.
+//
+// Examples:
+//     msh> zygote
+//     program                    runs spawn us    run ms   user ms    sys ms
+//     /usr/bin/true                12      410        14         3         6
+//
+static int zygote_command(char **words, FILE *out) {
+    bool reset = words[1] != NULL && strcmp(words[1], "-r") == 0;
+    if (words[1] != NULL && (!reset || words[2] != NULL)) {
+        fprintf(stderr, "usage: zygote [-r]\n");
+        return 1;
+    }
+    if (!options[OPTION_ZYGOTE].value) {
+        fprintf(out, "zygote: off\n");
+    } else if (zygote.fd == -1) {
+        fprintf(out, "zygote: not running\n");
+    }
+
+    struct zygote_stat **stats =
+        arena_alloc(&command_arena, (zygote.n_stats + 1) * sizeof *stats);
+    int n = 0;
+    for (int i = 0; i < ZYGOTE_STATS_BUCKETS; i++) {
+        for (struct zygote_stat *stat = zygote.stats[i]; stat != NULL;
+             stat = stat->next) {
+            stats[n++] = stat;
+        }
+    }
+
+    if (reset) {
+        for (int i = 0; i < n; i++) {
+            free(stats[i]->path);
+            free(stats[i]);
+        }
+        memset(zygote.stats, 0, sizeof zygote.stats);
+        zygote.n_stats = 0;
+        return 0;
+    }
+
+    qsort(stats, n, sizeof *stats, compare_stats);
+    if (n > 0) {
+        fprintf(out, "%-24s %6s %8s %9s %9s %9s\n", "program", "runs",
+                "spawn us", "run ms", "user ms", "sys ms");
+    }
+    for (int i = 0; i < n; i++) {
+        struct zygote_stat *stat = stats[i];
+        fprintf(out, "%-24s %6lu %8ld %9ld %9ld %9ld\n", stat->path,
+                stat->runs, stat->spawn_ns / (long)stat->runs / 1000,
+                stat->run_ns / 1000000, stat->user_ns / 1000000,
+                stat->system_ns / 1000000);
+    }
+    return 0;
+}
+
+// Returns the builtin utility that runs the command in words, or NULL
+static const struct utility *find_utility(char **words) {
+    for (size_t i = 0; i < sizeof utilities / sizeof *utilities; i++) {
+        const struct utility *utility = &utilities[i];
+        if (strcmp(words[0], utility->name) == 0) {
+            if (utility->accepts != NULL && !utility->accepts(words)) {
+                return NULL;
+            }
+            return utility;
+        }
+    }
+    return NULL;
+}
+
+// Runs a builtin or builtin utility in msh itself, with command's '<', '>'
+// or '>>' applied to the fds it reads and writes
+static void run_in_process(struct command *command) {
+    struct spawn_actions actions = {.count = 0};
+    redirect_actions(command, &actions);
+    char **arguments = command->argv;
+
+    int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+    bool opened = true;
+    for (int i = 0; i < actions.count; i++) {
+        struct spawn_action *action = &actions.list[i];
+        int fd = open(action->path, action->flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s\n", action->path, strerror(errno));
+            opened = false;
+            break;
+        }
+        fds[action->fd] = fd;
+    }
+
+    const struct utility *utility = find_utility(arguments);
+    if (opened && utility != NULL) {
+        // anything msh has printed goes first
+        fflush(stdout);
+        last_status = utility->run(arguments, fds[0], fds[1]);
+    } else if (opened) {
+        FILE *out = stdout;
+        if (fds[1] != STDOUT_FILENO) {
+            out = fdopen(fds[1], "w");
+            assert(out != NULL);
+        }
+        last_status = run_builtin(arguments, out);
+        if (out != stdout) {
+            fclose(out);
+            fds[1] = STDOUT_FILENO;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] != i) {
+            close(fds[i]);
+        }
+    }
+}
+
+// Runs the builtin command in words, printing to out, and returns its exit
+// status
+static int run_builtin(char **words, FILE *out) {
+    char *program = words[0];
+    int number_arguments = 0;
+    while (words[number_arguments] != NULL) {
+        number_arguments++;
+    }
+
+    // Subset 0: pwd and cd
+    if (strcmp(program, "pwd") == 0) {
+        // check the arguments
+        if (number_arguments == 1) {
+            return pwd(out);
+        }
+        fprintf(stderr, "pwd: too many arguments\n");
+        return 1;
+    } else if (strcmp(program, "cd") == 0) {
+        // check the arguments
+        if (number_arguments <= 2) {
+            return cd(words);
+        }
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    } else if (strcmp(program, "history") == 0) {
+        // Subset 2
+        // history called, print the command history
+        int print_num = DEFAULT_HISTORY_SHOWN;
+        // check the arguments
+        int not_valid = history_check_arg(&print_num, number_arguments, words);
+        if (not_valid) {
+            return 1;
+        }
+        print_history(out, print_num);
+        return 0;
+    } else if (strcmp(program, "hash") == 0) {
+        return hash_command(words, out);
+    } else if (strcmp(program, "set") == 0) {
+        return set_command(words, out);
+    } else if (strcmp(program, "zygote") == 0) {
+        return zygote_command(words, out);
+    } else if (strcmp(program, "admit") == 0) {
+        return admit_command(words, out);
+    } else if (strcmp(program, "jobs") == 0) {
+        return jobs_command(words, out);
+    } else if (strcmp(program, "wait") == 0) {
+        return wait_command(words);
+    } else if (strcmp(program, "fg") == 0) {
+        return fg_command(words);
+    }
+    return 0;
+}
+
+// Writes all length bytes of s to fd, returning false if it can't
+static bool write_all(int fd, const char *s, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, s, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        s += n;
+        length -= n;
+    }
+    return true;
+}
+
+//
+// Implement the `true' and `false' utilities.
+//
+static int utility_true(char **words, int in, int out) {
+    (void)words, (void)in, (void)out;
+    return 0;
+}
+
+static int utility_false(char **words, int in, int out) {
+    (void)words, (void)in, (void)out;
+    return 1;
+}
+
+//
+// Implement the `echo' utility, which writes its arguments separated by
+// spaces, and a newline unless the first argument is `-n'.
+//
+static int utility_echo(char **words, int in, int out) {
+    (void)in;
+    bool newline = true;
+    int first = 1;
+    if (words[1] != NULL && strcmp(words[1], "-n") == 0) {
+        newline = false;
+        first = 2;
+    }
+    size_t length = 1;
+    for (int i = first; words[i] != NULL; i++) {
+        length += strlen(words[i]) + 1;
+    }
+    // not the arena, as it may be running on a thread
+    char *line = malloc(length);
+    assert(line != NULL);
+    char *end = line;
+    for (int i = first; words[i] != NULL; i++) {
+        if (i > first) {
+            *end++ = ' ';
+        }
+        end = stpcpy(end, words[i]);
+    }
+    if (newline) {
+        *end++ = '\n';
+    }
+    int status = 0;
+    if (!write_all(out, line, end - line)) {
+        if (errno != EPIPE) {
+            fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+        }
+        status = 1;
+    }
+    free(line);
+    return status;
+}
+
+//
+// Implement the `printf' utility.
+//
+// Synopsis:
+//     printf FORMAT [ARGUMENT...]
+//
+// FORMAT may have the escapes \\ \a \b \f \n \r \t \v and \0NNN, and the
+// conversions %% %b %c %d %i %o %u %x %X %e %E %f %F %g %G %s, with flags,
+// width and precision.  FORMAT is reused while arguments are left.
+//
+static int utility_printf(char **words, int in, int out) {
+    (void)in;
+    if (words[1] == NULL) {
+        fprintf(stderr, "usage: printf FORMAT [ARGUMENT...]\n");
+        return 1;
+    }
+    char *format = words[1];
+    char **arguments = words + 2;
+    struct buffer result = {0};
+    int status = 0;
+    do {
+        char **used = arguments;
+        bool stop = false;
+        for (char *f = format; *f != '\0' && !stop; f++) {
+            if (*f == '\\') {
+                f += printf_escape(f, &result, false, &stop) - 1;
+                continue;
+            }
+            if (*f != '%') {
+                buffer_add(&result, f, 1);
+                continue;
+            }
+            if (f[1] == '%') {
+                buffer_add(&result, "%", 1);
+                f++;
+                continue;
+            }
+
+            // copy the flags, width and precision into a format of our own
+            char spec[32] = "%";
+            size_t n = 1;
+            f++;
+            while (*f != '\0' && strchr("-+ #0", *f) && n < 8) {
+                spec[n++] = *f++;
+            }
+            while (isdigit((unsigned char)*f) && n < 16) {
+                spec[n++] = *f++;
+            }
+            if (*f == '.') {
+                spec[n++] = *f++;
+                while (isdigit((unsigned char)*f) && n < 24) {
+                    spec[n++] = *f++;
+                }
+            }
+            char conversion = *f;
+            if (conversion == '\0' || !strchr("bcdiouxXeEfFgGs", conversion)) {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n",
+                        conversion);
+                free(result.data);
+                return 1;
+            }
+            char *argument = *arguments != NULL ? *arguments++ : "";
+
+            if (conversion == 'b') {
+                // the argument's escapes are expanded; \c stops everything
+                struct buffer expanded = {0};
+                for (char *a = argument; *a != '\0' && !stop; a++) {
+                    if (*a == '\\') {
+                        a += printf_escape(a, &expanded, true, &stop) - 1;
+                    } else {
+                        buffer_add(&expanded, a, 1);
+                    }
+                }
+                if (n > 1) {
+                    // then padded and cut like a `%s' argument
+                    buffer_add(&expanded, "", 1);
+                    strcpy(spec + n, "s");
+                    buffer_format(&result, spec, expanded.data);
+                } else if (expanded.length > 0) {
+                    // as it is, keeping any \0 it has
+                    buffer_add(&result, expanded.data, expanded.length);
+                }
+                free(expanded.data);
+            } else if (conversion == 's' || conversion == 'c') {
+                strcpy(spec + n, conversion == 's' ? "s" : "c");
+                if (conversion == 's') {
+                    buffer_format(&result, spec, argument);
+                } else {
+                    buffer_format(&result, spec, argument[0]);
+                }
+            } else if (strchr("diouxX", conversion)) {
+                char *end;
+                errno = 0;
+                long long value = *argument == '\'' || *argument == '"'
+                                      ? (unsigned char)argument[1]
+                                      : strtoll(argument, &end, 0);
+                if (*argument != '\'' && *argument != '"' &&
+                    (errno != 0 || *end != '\0')) {
+                    fprintf(stderr, "printf: %s: invalid number\n", argument);
+                    status = 1;
+                }
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                buffer_format(&result, spec, value);
+            } else {
+                char *end;
+                double value = strtod(argument, &end);
+                if (*end != '\0') {
+                    fprintf(stderr, "printf: %s: invalid number\n", argument);
+                    status = 1;
+                }
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                buffer_format(&result, spec, value);
+            }
+        }
+        if (stop || arguments == used) {
+            // \c, or the format took no arguments
+            break;
+        }
+    } while (*arguments != NULL);
+
+    if (!write_all(out, result.data, result.length)) {
+        if (errno != EPIPE) {
+            fprintf(stderr, "printf: write error: %s\n", strerror(errno));
+        }
+        status = 1;
+    }
+    free(result.data);
+    return status;
+}
+
+// Adds the escape sequence starting at the '\' at s to result, returning
+// how many characters it took up.  In a `%b' argument, \0 may be followed
+// by up to three octal digits and `\c' sets stop.
+static int printf_escape(char *s, struct buffer *result, bool argument,
+                         bool *stop) {
+    static const char escapes[] = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+    char c = s[1];
+    for (const char *e = escapes; *e != '\0'; e += 2) {
+        if (c == e[0]) {
+            buffer_add(result, &e[1], 1);
+            return 2;
+        }
+    }
+    if (argument && c == 'c') {
+        *stop = true;
+        return 2;
+    }
+    if (c >= '0' && c <= '7') {
+        // \NNN in the format, \0NNN in a `%b' argument
+        int i = argument && c == '0' ? 2 : 1;
+        int value = 0;
+        int digits = 0;
+        while (digits < 3 && s[i] >= '0' && s[i] <= '7') {
+            value = value * 8 + s[i++] - '0';
+            digits++;
+        }
+        char byte = value;
+        buffer_add(result, &byte, 1);
+        return i;
+    }
+    // not an escape: the backslash stands for itself
+    buffer_add(result, s, 1);
+    return 1;
+}
+
+// Appends length bytes of s to buffer
+static void buffer_add(struct buffer *buffer, const char *s, size_t length) {
+    if (buffer->length + length > buffer->size) {
+        buffer->size = 2 * (buffer->length + length) + 64;
+        buffer->data = realloc(buffer->data, buffer->size);
+        assert(buffer->data != NULL);
+    }
+    memcpy(buffer->data + buffer->length, s, length);
+    buffer->length += length;
+}
+
+// Appends format, printed as printf(3) would with the arguments after it,
+// to buffer, however long it turns out
+static void buffer_format(struct buffer *buffer, const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    if (length <= 0) {
+        return;
+    }
+    // room for the '\0' vsnprintf adds too
+    if (buffer->length + length + 1 > buffer->size) {
+        buffer->size = 2 * (buffer->length + length + 1) + 64;
+        buffer->data = realloc(buffer->data, buffer->size);
+        assert(buffer->data != NULL);
+    }
+    va_start(arguments, format);
+    vsnprintf(buffer->data + buffer->length, length + 1, format, arguments);
+    va_end(arguments);
+    buffer->length += length;
+}
+
+//
+// Implement the `test' and `[' utilities, which exit with 0 when the
+// expression is true, 1 when it's false, and 2 when it's invalid.
+//
+// Synopsis:
+//     test EXPRESSION
+//     [ EXPRESSION ]
+//
+// EXPRESSION is made of `! E', `E -a E', `E -o E', `( E )', the file tests
+// -b -c -d -e -f -g -h -L -p -r -s -S -t -u -w -x, the string tests -n -z
+// `S1 = S2' and `S1 != S2', the integer comparisons -eq -ne -lt -le -gt
+// -ge, and a lone string, which is true when it isn't empty.
+//
+static int utility_test(char **words, int in, int out) {
+    (void)in, (void)out;
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+    if (strcmp(words[0], "[") == 0) {
+        if (strcmp(words[count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        count--;
+    }
+    struct test_parser parser = {.words = words + 1, .count = count - 1};
+    if (parser.count == 0) {
+        return 1;
+    }
+    bool result = test_or(&parser);
+    if (!parser.error && parser.at != parser.count) {
+        fprintf(stderr, "test: %s: unexpected argument\n",
+                parser.words[parser.at]);
+        parser.error = true;
+    }
+    return parser.error ? 2 : !result;
+}
+
+// The word the parser is at, or "" at the end
+static char *test_peek(struct test_parser *parser, int ahead) {
+    int at = parser->at + ahead;
+    return at < parser->count ? parser->words[at] : "";
+}
+
+// EXPRESSION: E -o E ...
+static bool test_or(struct test_parser *parser) {
+    bool result = test_and(parser);
+    while (!parser->error && strcmp(test_peek(parser, 0), "-o") == 0) {
+        parser->at++;
+        result = test_and(parser) || result;
+    }
+    return result;
+}
+
+// E -a E ...
+static bool test_and(struct test_parser *parser) {
+    bool result = test_not(parser);
+    while (!parser->error && strcmp(test_peek(parser, 0), "-a") == 0) {
+        parser->at++;
+        result = test_not(parser) && result;
+    }
+    return result;
+}
+
+// ! E
+static bool test_not(struct test_parser *parser) {
+    // `! = x' compares "!", but `! x' negates
+    if (strcmp(test_peek(parser, 0), "!") == 0 &&
+        parser->at + 1 < parser->count &&
+        !test_binary_operator(test_peek(parser, 1))) {
+        parser->at++;
+        return !test_not(parser);
+    }
+    return test_primary(parser);
+}
+
+// whether s is one of the binary operators
+static bool test_binary_operator(char *s) {
+    static const char *const operators[] = {
+        "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+    };
+    for (size_t i = 0; i < sizeof operators / sizeof *operators; i++) {
+        if (strcmp(s, operators[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a comparison, ( E ), a unary test or a lone string
+static bool test_primary(struct test_parser *parser) {
+    if (parser->at >= parser->count) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = true;
+        return false;
+    }
+    char *word = test_peek(parser, 0);
+
+    // a binary operator takes precedence, so `-n = x' compares "-n"
+    if (parser->at + 2 < parser->count &&
+        test_binary_operator(test_peek(parser, 1))) {
+        char *operator = test_peek(parser, 1);
+        char *right = test_peek(parser, 2);
+        parser->at += 3;
+        if (strcmp(operator, "=") == 0) {
+            return strcmp(word, right) == 0;
+        } else if (strcmp(operator, "!=") == 0) {
+            return strcmp(word, right) != 0;
+        }
+        long long a, b;
+        if (!test_integer(word, &a) || !test_integer(right, &b)) {
+            parser->error = true;
+            return false;
+        }
+        switch (operator[2]) {
+        case 'q':
+            return a == b;
+        case 'e':
+            return operator[1] == 'n' ? a != b : a >= b; // -ne, -ge
+        case 't':
+            return operator[1] == 'l' ? a < b : a > b;
+        default:
+            return a <= b; // -le
+        }
+    }
+
+    if (strcmp(word, "(") == 0 && parser->at + 1 < parser->count) {
+        parser->at++;
+        bool result = test_or(parser);
+        if (!parser->error && strcmp(test_peek(parser, 0), ")") != 0) {
+            fprintf(stderr, "test: missing ')'\n");
+            parser->error = true;
+        }
+        parser->at++;
+        return result;
+    }
+
+    if (word[0] == '-' && word[1] != '\0' && word[2] == '\0' &&
+        strchr("bcdefghLprsStuwxnz", word[1]) &&
+        parser->at + 1 < parser->count) {
+        char *operand = test_peek(parser, 1);
+        parser->at += 2;
+        return test_unary(word[1], operand, parser);
+    }
+
+    // a lone string
+    parser->at++;
+    return word[0] != '\0';
+}
+
+// Parses s as an integer for a comparison
+static bool test_integer(char *s, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        return false;
+    }
+    return true;
+}
+
+// Applies the unary test -operator to operand
+static bool test_unary(char operator, char *operand,
+                       struct test_parser *parser) {
+    struct stat s;
+    switch (operator) {
+    case 'n':
+        return operand[0] != '\0';
+    case 'z':
+        return operand[0] == '\0';
+    case 'h':
+    case 'L':
+        return lstat(operand, &s) == 0 && S_ISLNK(s.st_mode);
+    case 't': {
+        long long fd;
+        if (!test_integer(operand, &fd)) {
+            parser->error = true;
+            return false;
+        }
+        return fd >= 0 && fd <= INT_MAX && isatty(fd);
+    }
+    case 'r':
+        return access(operand, R_OK) == 0;
+    case 'w':
+        return access(operand, W_OK) == 0;
+    case 'x':
+        return access(operand, X_OK) == 0;
+    }
+    if (stat(operand, &s) != 0) {
+        return false;
+    }
+    switch (operator) {
+    case 'b':
+        return S_ISBLK(s.st_mode);
+    case 'c':
+        return S_ISCHR(s.st_mode);
+    case 'd':
+        return S_ISDIR(s.st_mode);
+    case 'f':
+        return S_ISREG(s.st_mode);
+    case 'g':
+        return (s.st_mode & S_ISGID) != 0;
+    case 'p':
+        return S_ISFIFO(s.st_mode);
+    case 's':
+        return s.st_size > 0;
+    case 'S':
+        return S_ISSOCK(s.st_mode);
+    case 'u':
+        return (s.st_mode & S_ISUID) != 0;
+    default:
+        return true; // -e
+    }
+}
+
+//
+// Implement the `sleep' utility, which waits for the total of its
+// arguments, each a number of seconds (which may have a fraction) with an
+// optional suffix: s, m for minutes, h for hours or d for days.  It may be
+// running on a thread, so background jobs are reaped at the next prompt.
+//
+static int utility_sleep(char **words, int in, int out) {
+    (void)in, (void)out;
+    if (words[1] == NULL) {
+        fprintf(stderr, "usage: sleep NUMBER[smhd]...\n");
+        return 1;
+    }
+    double seconds = 0;
+    for (int i = 1; words[i] != NULL; i++) {
+        char *end;
+        double value = strtod(words[i], &end);
+        double unit = 1;
+        if (*end != '\0' && end[1] == '\0') {
+            const char *units = "smhd";
+            const double scales[] = {1, 60, 3600, 86400};
+            char *u = strchr(units, *end);
+            if (u != NULL) {
+                unit = scales[u - units];
+                end++;
+            }
+        }
+        if (end == words[i] || *end != '\0' || !(value >= 0)) {
+            fprintf(stderr, "sleep: %s: invalid time interval\n", words[i]);
+            return 1;
+        }
+        seconds += value * unit;
+    }
+    if (seconds > TIMEOUT_MAX_SECONDS) {
+        // e.g. `sleep inf', which is as good as forever
+        seconds = TIMEOUT_MAX_SECONDS;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    time_t whole = seconds;
+    long nanoseconds = deadline.tv_nsec + (seconds - whole) * 1e9;
+    deadline.tv_sec += whole + nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+           EINTR) {
+    }
+    return 0;
+}
+
+//
+// Implement the `cat' utility, which copies each file in turn, or standard
+// input when there are none or for `-', to standard output.  `-u' is
+// accepted and ignored, as output is never buffered.
+//
+static int utility_cat(char **words, int in, int out) {
+    int first = 1;
+    if (words[1] != NULL && strcmp(words[1], "-u") == 0) {
+        first = 2;
+    }
+    char *stdin_only[] = {"-", NULL};
+    char **files = words[first] != NULL ? words + first : stdin_only;
+
+    int status = 0;
+    char *buffer = malloc(CAT_BUFFER_SIZE);
+    assert(buffer != NULL);
+    for (int i = 0; files[i] != NULL; i++) {
+        int fd = in;
+        if (strcmp(files[i], "-") != 0) {
+            fd = open(files[i], O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+        ssize_t n;
+        while ((n = read(fd, buffer, CAT_BUFFER_SIZE)) != 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+                status = 1;
+                break;
+            }
+            if (!write_all(out, buffer, n)) {
+                // a closed pipe just means the reader has had enough
+                if (errno != EPIPE) {
+                    fprintf(stderr, "cat: write error: %s\n",
+                            strerror(errno));
+                }
+                status = 1;
+                break;
+            }
+        }
+        if (fd != in) {
+            close(fd);
+        }
+    }
+    free(buffer);
+    return status;
+}
+
+//
+// Implement the `tee' utility, which copies standard input to standard
+// output and to each FILE.
+//
+// Synopsis:
+//     tee [-a] [FILE...]
+//
+// With `-a', appends to the FILEs rather than replacing them.  When
+// standard input is a pipe and every output is a pipe or a regular file,
+// the data never passes through msh: see `tee_splice'.  A FILE that is a
+// named pipe gets the same treatment, so with mkfifo(1) one stream can
+// feed several programs at once.  Otherwise it reads and writes.
+//
+// Examples:
+//     msh> ls | tee files.txt | wc -l
+//     msh> mkfifo counted
+//     msh> wc -c < counted &
+//     msh> cat big.log | tee counted | gzip > big.log.gz
+//
+static int utility_tee(char **words, int in, int out) {
+    bool append = false;
+    int first = 1;
+    if (words[1] != NULL && strcmp(words[1], "-a") == 0) {
+        append = true;
+        first = 2;
+    }
+    int count = 1;
+    while (words[first + count - 1] != NULL) {
+        count++;
+    }
+    struct tee_output *outputs = malloc(count * sizeof *outputs);
+    assert(outputs != NULL);
+    outputs[0] = (struct tee_output){.fd = out, .name = "standard output"};
+    int n_outputs = 1;
+
+    int status = 0;
+    for (int i = first; words[i] != NULL; i++) {
+        int fd = open(words[i],
+                      O_WRONLY | O_CREAT | O_CLOEXEC |
+                          (append ? O_APPEND : O_TRUNC),
+                      0644);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", words[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        outputs[n_outputs++] = (struct tee_output){.fd = fd, .name = words[i]};
+    }
+
+    int copied = tee_splice(in, outputs, n_outputs);
+    if (copied == -1) {
+        copied = tee_copy(in, outputs, n_outputs);
+    }
+    for (int i = 1; i < n_outputs; i++) {
+        close(outputs[i].fd);
+    }
+    free(outputs);
+    return status | copied;
+}
+
+//
+// Copy in to every one of outputs without reading the data into msh.
+//
+// Each block is spliced from `in' into a pipe of tee's own, `scratch',
+// and tee(2) duplicates it from there into each output that is a pipe.
+// A regular file, or a pipe tee(2) couldn't fit the whole block into,
+// gets (the rest of) it through a second pipe, `spare', which is empty
+// and as big as `scratch' so always takes all of it, and is spliced on
+// from there.  The block is then dropped from `scratch'.
+//
+// Returns -1, having read nothing, if the fds don't allow this;
+// otherwise returns 0, or 1 if anything couldn't be written.
+//
+static int tee_splice(int in, struct tee_output *outputs, int n_outputs) {
+    struct stat s;
+    if (fstat(in, &s) != 0 || !S_ISFIFO(s.st_mode)) {
+        return -1;
+    }
+    for (int i = 0; i < n_outputs; i++) {
+        // splice(2) can't append
+        if (fstat(outputs[i].fd, &s) != 0 ||
+            !(S_ISFIFO(s.st_mode) || S_ISREG(s.st_mode)) ||
+            (fcntl(outputs[i].fd, F_GETFL) & O_APPEND)) {
+            return -1;
+        }
+        outputs[i].pipe = S_ISFIFO(s.st_mode);
+    }
+
+    int scratch[2], spare[2];
+    if (pipe2(scratch, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    int size = fcntl(scratch[1], F_GETPIPE_SZ);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null == -1 || size == -1 || pipe2(spare, O_CLOEXEC) == -1) {
+        close(scratch[0]);
+        close(scratch[1]);
+        if (null != -1) {
+            close(null);
+        }
+        return -1;
+    }
+    fcntl(spare[1], F_SETPIPE_SZ, size);
+
+    int status = 0;
+    int live = n_outputs;
+    while (live > 0) {
+        ssize_t n = splice(in, NULL, scratch[1], NULL, size, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "tee: read error: %s\n", strerror(errno));
+            status = 1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n_outputs; i++) {
+            if (outputs[i].failed) {
+                continue;
+            }
+            if (!tee_splice_output(&outputs[i], scratch[0], spare, null, n)) {
+                if (errno != EPIPE) {
+                    fprintf(stderr, "tee: %s: %s\n", outputs[i].name,
+                            strerror(errno));
+                }
+                outputs[i].failed = true;
+                status = 1;
+                live--;
+            }
+        }
+        splice_all(scratch[0], null, n);
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    close(spare[0]);
+    close(spare[1]);
+    close(null);
+    return status;
+}
+
+// Copies the n bytes in the scratch pipe to output, returning false if it
+// can't
+static bool tee_splice_output(struct tee_output *output, int scratch,
+                              int spare[2], int null, size_t n) {
+    size_t done = 0;
+    if (output->pipe) {
+        ssize_t copied;
+        do {
+            copied = tee(scratch, output->fd, n, 0);
+        } while (copied == -1 && errno == EINTR);
+        if (copied == -1) {
+            return false;
+        }
+        done = copied;
+    }
+    if (done == n) {
+        return true;
+    }
+    if (tee(scratch, spare[1], n, 0) != (ssize_t)n) {
+        return false;
+    }
+    // skip what output already has, and splice the rest
+    bool ok = splice_all(spare[0], null, done) &&
+              splice_all(spare[0], output->fd, n - done);
+    if (!ok) {
+        // leave the spare pipe empty for the next output
+        int err = errno;
+        while (splice(spare[0], NULL, null, NULL, n, SPLICE_F_NONBLOCK) > 0) {
+        }
+        errno = err;
+    }
+    return ok;
+}
+
+// Moves length bytes from the pipe from to to, returning false if it can't
+static bool splice_all(int from, int to, size_t length) {
+    while (length > 0) {
+        ssize_t n = splice(from, NULL, to, NULL, length, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        length -= n;
+    }
+    return true;
+}
+
+// Copies in to every one of outputs by reading and writing, returning 0,
+// or 1 if anything couldn't be read or written
+static int tee_copy(int in, struct tee_output *outputs, int n_outputs) {
+    int status = 0;
+    int live = n_outputs;
+    char *buffer = malloc(CAT_BUFFER_SIZE);
+    assert(buffer != NULL);
+    while (live > 0) {
+        ssize_t n = read(in, buffer, CAT_BUFFER_SIZE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "tee: read error: %s\n", strerror(errno));
+            status = 1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n_outputs; i++) {
+            if (!outputs[i].failed && !write_all(outputs[i].fd, buffer, n)) {
+                if (errno != EPIPE) {
+                    fprintf(stderr, "tee: %s: %s\n", outputs[i].name,
+                            strerror(errno));
+                }
+                outputs[i].failed = true;
+                status = 1;
+                live--;
+            }
+        }
+    }
+    free(buffer);
+    return status;
+}
+
+//
+// Implement the `shard' utility, which runs copies of a program side by
+// side on parts of its input.
+//
+// Synopsis:
+//     shard [-j JOBS] [-k] PROGRAM [ARGUMENT...]
+//
+// Standard input is cut into blocks of about `SHARD_BLOCK_SIZE' bytes,
+// always at the end of a line, and the blocks are shared out between
+// JOBS copies of PROGRAM (one per CPU by default), each copy getting the
+// next block as soon as it has taken the last.  Their output is written
+// out a line at a time, in whatever order it comes.
+//
+// With `-k', the output keeps the order of the input: each block goes to
+// a copy of PROGRAM of its own, up to JOBS at once, and each copy's output
+// is written out once those of the blocks before it have been.
+//
+// Exits with the first non-zero exit status of any copy, or 0.
+//
+// Examples:
+//     msh> cat access.log | shard -j 4 grep -c error
+//     msh> cat *.json | shard -k ./parse | wc -l
+//
+static int utility_shard(char **words, int in, int out) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool ordered = false;
+    int i = 1;
+    for (; words[i] != NULL && words[i][0] == '-'; i++) {
+        if (strcmp(words[i], "-k") == 0) {
+            ordered = true;
+        } else if (strcmp(words[i], "-j") == 0 && words[i + 1] != NULL) {
+            char *end;
+            jobs = strtol(words[++i], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > SHARD_MAX_JOBS) {
+                fprintf(stderr, "shard: %s: invalid number of jobs\n",
+                        words[i]);
+                return 2;
+            }
+        } else {
+            break;
+        }
+    }
+    if (words[i] == NULL || words[i][0] == '-') {
+        fprintf(stderr, "usage: shard [-j JOBS] [-k] PROGRAM [ARGUMENT...]\n");
+        return 2;
+    }
+    char *program = path_search(words[i]);
+    if (program == NULL) {
+        fprintf(stderr, "shard: %s: command not found\n", words[i]);
+        return 127;
+    }
+
+    // a copy that stops reading early mustn't kill msh with SIGPIPE
+    sigset_t sigpipe, old;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old);
+
+    struct shard shard = {
+        .arguments = words + i,
+        .program = program,
+        .ordered = ordered,
+        .out = out,
+        .workers = calloc(jobs, sizeof *shard.workers),
+    };
+    assert(shard.workers != NULL);
+    if (!ordered) {
+        // the same copies take every block
+        for (; shard.n_workers < jobs; shard.n_workers++) {
+            if (!shard_start(&shard, &shard.workers[shard.n_workers])) {
+                break;
+            }
+        }
+    }
+    shard_run(&shard, in, jobs);
+    free(shard.workers);
+    free(program);
+
+    // drop a SIGPIPE that was raised, then put the mask back
+    struct timespec now = {0, 0};
+    while (sigtimedwait(&sigpipe, NULL, &now) == SIGPIPE) {
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return shard.status;
+}
+
+// Reads in and hands out blocks of it until every copy has finished and
+// all of their output has been written
+static void shard_run(struct shard *shard, int in, long jobs) {
+    struct buffer input = {.data = NULL};
+    bool input_ended = false;
+    struct pollfd *fds = malloc((2 * jobs + 1) * sizeof *fds);
+    assert(fds != NULL);
+    while (1) {
+        // give out every block there is a copy ready for
+        while (input.length > 0 &&
+               (input_ended || (input.length >= SHARD_BLOCK_SIZE &&
+                                memrchr(input.data, '\n', input.length)))) {
+            struct shard_worker *worker = shard_idle(shard, jobs);
+            if (worker == NULL) {
+                break;
+            }
+            // the block is everything up to the last newline, and the
+            // rest is copied to a buffer of its own
+            char *newline = memrchr(input.data, '\n', input.length);
+            size_t length = input_ended || newline == NULL
+                                ? input.length
+                                : (size_t)(newline + 1 - input.data);
+            worker->block = input.data;
+            worker->block_length = length;
+            worker->written = 0;
+            struct buffer rest = {.data = NULL};
+            buffer_add(&rest, input.data + length, input.length - length);
+            input = rest;
+        }
+        if (input_ended && input.length == 0) {
+            // nothing more to come, so each copy gets EOF once it has
+            // taken the last of its block
+            for (int i = 0; i < shard->n_workers; i++) {
+                struct shard_worker *worker = &shard->workers[i];
+                if (worker->block == NULL && worker->in != -1) {
+                    close(worker->in);
+                    worker->in = -1;
+                }
+            }
+        }
+
+        int n_fds = 0;
+        bool read_input = !input_ended && input.length < SHARD_BLOCK_SIZE;
+        if (read_input) {
+            fds[n_fds++] = (struct pollfd){.fd = in, .events = POLLIN};
+        }
+        for (int i = 0; i < shard->n_workers; i++) {
+            struct shard_worker *worker = &shard->workers[i];
+            if (worker->block != NULL) {
+                fds[n_fds++] =
+                    (struct pollfd){.fd = worker->in, .events = POLLOUT};
+            }
+            if (worker->out != -1) {
+                fds[n_fds++] =
+                    (struct pollfd){.fd = worker->out, .events = POLLIN};
+            }
+        }
+        if (n_fds == 0) {
+            break;
+        }
+        if (poll(fds, n_fds, -1) == -1 && errno != EINTR) {
+            perror("shard: poll");
+            shard->status = 2;
+            break;
+        }
+
+        if (read_input && fds[0].revents != 0) {
+            if (input.size - input.length < SHARD_BLOCK_SIZE) {
+                input.size = input.length + SHARD_BLOCK_SIZE;
+                input.data = realloc(input.data, input.size);
+                assert(input.data != NULL);
+            }
+            ssize_t n = read(in, input.data + input.length, SHARD_BLOCK_SIZE);
+            if (n == -1 && errno != EINTR && errno != EAGAIN) {
+                fprintf(stderr, "shard: read error: %s\n", strerror(errno));
+                shard->status = 2;
+            }
+            if (n > 0) {
+                input.length += n;
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                input_ended = true;
+            }
+        }
+        for (int i = 0; i < shard->n_workers;) {
+            if (shard_step(shard, &shard->workers[i], i == 0)) {
+                // it has finished
+                shard_finish(shard, i);
+            } else {
+                i++;
+            }
+        }
+    }
+    free(input.data);
+    free(fds);
+    for (int i = shard->n_workers - 1; i >= 0; i--) {
+        shard_finish(shard, i);
+    }
+}
+
+// Returns a copy ready for a block, starting one for it with `-k', or
+// NULL if none is
+static struct shard_worker *shard_idle(struct shard *shard, long jobs) {
+    if (shard->ordered) {
+        if (shard->n_workers == jobs || !admit(shard->n_workers, jobs)) {
+            return NULL;
+        }
+        struct shard_worker *worker = &shard->workers[shard->n_workers];
+        if (!shard_start(shard, worker)) {
+            return NULL;
+        }
+        shard->n_workers++;
+        return worker;
+    }
+    for (int k = 0; k < shard->n_workers; k++) {
+        // round robin, so the copies all get going
+        int i = (shard->next + k) % shard->n_workers;
+        struct shard_worker *worker = &shard->workers[i];
+        if (worker->block == NULL && worker->in != -1) {
+            shard->next = i + 1;
+            return worker;
+        }
+    }
+    return NULL;
+}
+
+// Starts a copy of the program as worker, returning false if it can't
+static bool shard_start(struct shard *shard, struct shard_worker *worker) {
+    *worker = (struct shard_worker){.in = -1, .out = -1};
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1) {
+        perror("shard: pipe");
+        shard->status = 2;
+        return false;
+    }
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        perror("shard: pipe");
+        close(to[0]);
+        close(to[1]);
+        shard->status = 2;
+        return false;
+    }
+    struct spawn_actions actions = {.count = 0};
+    spawn_add_dup2(&actions, to[0], STDIN_FILENO);
+    spawn_add_dup2(&actions, from[1], STDOUT_FILENO);
+    // the copies are waited for here, so they mustn't come from the zygote
+    extern char **environ;
+    int pidfd;
+    int err = spawn_direct(&worker->pid, &pidfd, shard->program, &actions,
+                           shard->arguments, environ);
+    if (pidfd != -1) {
+        close(pidfd);
+    }
+    close(to[0]);
+    close(from[1]);
+    if (err != 0) {
+        fprintf(stderr, "shard: %s: %s\n", shard->arguments[0],
+                strerror(err));
+        close(to[1]);
+        close(from[0]);
+        shard->status = 127;
+        return false;
+    }
+    worker->in = to[1];
+    worker->out = from[0];
+    fcntl(worker->in, F_SETFL, O_NONBLOCK);
+    fcntl(worker->out, F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+// Writes as much of worker's block as it will take, and passes on what
+// it has written.  head is whether its output comes next with `-k'.
+// Returns true once it has finished and all its output is out.
+static bool shard_step(struct shard *shard, struct shard_worker *worker,
+                       bool head) {
+    while (worker->block != NULL) {
+        ssize_t n = write(worker->in, worker->block + worker->written,
+                          worker->block_length - worker->written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0) {
+            worker->written += n;
+        }
+        bool stopped = n == -1 && errno != EAGAIN;
+        if (stopped || worker->written == worker->block_length) {
+            // it has taken it all, or stopped reading, so the rest goes
+            // nowhere and it gets no more
+            free(worker->block);
+            worker->block = NULL;
+            if (shard->ordered || stopped) {
+                close(worker->in);
+                worker->in = -1;
+            }
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+
+    char buffer[64 * 1024];
+    ssize_t n;
+    while (worker->out != -1 &&
+           (n = read(worker->out, buffer, sizeof buffer)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            break;
+        }
+        buffer_add(&worker->output, buffer, n);
+    }
+    if (worker->out != -1 && n == 0) {
+        close(worker->out);
+        worker->out = -1;
+    }
+
+    // without -k, only whole lines go out, so copies' lines don't mix
+    size_t length = worker->output.length;
+    if (!shard->ordered && worker->out != -1) {
+        char *newline = memrchr(worker->output.data, '\n', length);
+        length = newline != NULL ? (size_t)(newline + 1 - worker->output.data)
+                                 : 0;
+    }
+    if (length > 0 && (head || !shard->ordered)) {
+        if (!write_all(shard->out, worker->output.data, length) &&
+            errno != EPIPE) {
+            fprintf(stderr, "shard: write error: %s\n", strerror(errno));
+        }
+        memmove(worker->output.data, worker->output.data + length,
+                worker->output.length - length);
+        worker->output.length -= length;
+    }
+    return worker->in == -1 && worker->out == -1 &&
+           worker->output.length == 0;
+}
+
+// Waits for the i'th copy to exit and forgets it
+static void shard_finish(struct shard *shard, int i) {
+    struct shard_worker *worker = &shard->workers[i];
+    if (worker->in != -1) {
+        close(worker->in);
+    }
+    if (worker->out != -1) {
+        close(worker->out);
+    }
+    int status;
+    if (waitpid(worker->pid, &status, 0) == worker->pid && shard->status == 0) {
+        shard->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                          : 128 + WTERMSIG(status);
+    }
+    free(worker->block);
+    free(worker->output.data);
+    shard->n_workers--;
+    memmove(worker, worker + 1, (shard->n_workers - i) * sizeof *worker);
+}
+
+// whether word ends the words of a command line given to `accepts'
+static bool filter_end(char *word) {
+    return word == NULL || (word[0] != '\0' && word[1] == '\0' &&
+                            strchr(SPECIAL_CHARS, word[0]) != NULL);
+}
+
+// Reads the options of `wc' in words into filter, returning false if msh
+// doesn't handle them
+static bool wc_options(char **words, struct filter_options *filter) {
+    *filter = (struct filter_options){.file = NULL};
+    int i = 1;
+    for (; !filter_end(words[i]) && words[i][0] == '-' && words[i][1] != '\0';
+         i++) {
+        for (char *c = words[i] + 1; *c != '\0'; c++) {
+            if (*c == 'l') {
+                filter->lines = true;
+            } else if (*c == 'w') {
+                filter->words = true;
+            } else if (*c == 'c') {
+                filter->bytes = true;
+            } else {
+                return false;
+            }
+        }
+    }
+    if (!filter->lines && !filter->words && !filter->bytes) {
+        filter->lines = filter->words = filter->bytes = true;
+    }
+    if (!filter_end(words[i])) {
+        filter->file = words[i++];
+    }
+    return filter_end(words[i]);
+}
+
+// Reads the options of `head' or `tail' in words into filter, returning
+// false if msh doesn't handle them
+static bool lines_options(char **words, struct filter_options *filter) {
+    *filter = (struct filter_options){.count = 10};
+    int i = 1;
+    if (!filter_end(words[i]) && words[i][0] == '-' && words[i][1] != '\0') {
+        // -n N, -nN or -N
+        char *number = words[i] + 1;
+        if (strcmp(words[i], "-n") == 0) {
+            if (filter_end(words[i + 1])) {
+                return false;
+            }
+            number = words[++i];
+        } else if (*number == 'n') {
+            number++;
+        }
+        char *end;
+        errno = 0;
+        filter->count = strtol(number, &end, 10);
+        if (!isdigit((unsigned char)*number) || *end != '\0' || errno != 0) {
+            return false;
+        }
+        i++;
+    }
+    if (!filter_end(words[i])) {
+        filter->file = words[i++];
+    }
+    return filter_end(words[i]);
+}
+
+// Reads the options of `grep' in words into filter, returning false if msh
+// doesn't handle them: only -F, -v, -c and -q, and a pattern that matches
+// only itself
+static bool grep_options(char **words, struct filter_options *filter) {
+    *filter = (struct filter_options){.file = NULL};
+    bool fixed = false;
+    int i = 1;
+    for (; !filter_end(words[i]) && words[i][0] == '-' && words[i][1] != '\0';
+         i++) {
+        for (char *c = words[i] + 1; *c != '\0'; c++) {
+            if (*c == 'F') {
+                fixed = true;
+            } else if (*c == 'v') {
+                filter->invert = true;
+            } else if (*c == 'c') {
+                filter->counts = true;
+            } else if (*c == 'q') {
+                filter->quiet = true;
+            } else {
+                return false;
+            }
+        }
+    }
+    if (filter_end(words[i])) {
+        return false;
+    }
+    filter->pattern = words[i++];
+    if (!fixed && strpbrk(filter->pattern, "\\.[]*^$") != NULL) {
+        // a regular expression
+        return false;
+    }
+    if (!filter_end(words[i])) {
+        filter->file = words[i++];
+    }
+    return filter_end(words[i]);
+}
+
+static bool wc_accepts(char **words) {
+    struct filter_options filter;
+    return options[OPTION_FILTERS].value && wc_options(words, &filter);
+}
+
+static bool lines_accepts(char **words) {
+    struct filter_options filter;
+    return options[OPTION_FILTERS].value && lines_options(words, &filter);
+}
+
+static bool grep_accepts(char **words) {
+    struct filter_options filter;
+    return options[OPTION_FILTERS].value && grep_options(words, &filter);
+}
+
+// Opens filter's file for the utility called name, or returns in if it
+// reads standard input.  Prints an error and returns -1 if it can't.
+static int filter_open(char *name, struct filter_options *filter, int in) {
+    if (filter->file == NULL || strcmp(filter->file, "-") == 0) {
+        return in;
+    }
+    int fd = open(filter->file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", name,
+                filter->file, strerror(errno));
+    }
+    return fd;
+}
+
+// Counts the times c appears in the length bytes at s, with the widest
+// vectors this CPU has
+static size_t count_byte(const char *s, size_t length, char c) {
+#ifdef MSH_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return count_byte_avx2(s, length, c);
+    }
+    return count_byte_sse2(s, length, c);
+#else
+    return count_byte_scalar(s, length, c);
+#endif
+}
+
+static size_t count_byte_scalar(const char *s, size_t length, char c) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += s[i] == c;
+    }
+    return count;
+}
+
+#ifdef MSH_X86_SIMD
+// Count 16 bytes at a time with SSE2.  Each byte of `sums' counts the
+// matches in its lane, so they are added up before any can pass 255.
+static size_t count_byte_sse2(const char *s, size_t length, char c) {
+    __m128i match = _mm_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    while (length - i >= 16) {
+        __m128i sums = _mm_setzero_si128();
+        for (int k = 0; k < 255 && length - i >= 16; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            sums = _mm_sub_epi8(sums, _mm_cmpeq_epi8(v, match));
+        }
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes,
+                         _mm_sad_epu8(sums, _mm_setzero_si128()));
+        count += lanes[0] + lanes[1];
+    }
+    return count + count_byte_scalar(s + i, length - i, c);
+}
+
+// Count 32 bytes at a time with AVX2
+__attribute__((target("avx2"))) static size_t
+count_byte_avx2(const char *s, size_t length, char c) {
+    __m256i match = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    while (length - i >= 32) {
+        __m256i sums = _mm256_setzero_si256();
+        for (int k = 0; k < 255 && length - i >= 32; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+            sums = _mm256_sub_epi8(sums, _mm256_cmpeq_epi8(v, match));
+        }
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes,
+                            _mm256_sad_epu8(sums, _mm256_setzero_si256()));
+        count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return count + count_byte_scalar(s + i, length - i, c);
+}
+#endif
+
+//
+// Implement the `wc' utility, with the `filters' option on.
+//
+// Synopsis:
+//     wc [-lwc] [FILE]
+//
+// Prints the number of lines, words and bytes in FILE or standard input,
+// or just the ones asked for, laid out as coreutils does.  Lines are
+// counted a vector at a time.
+//
+static int utility_wc(char **words, int in, int out) {
+    struct filter_options filter;
+    wc_options(words, &filter);
+    int fd = filter_open("wc", &filter, in);
+    if (fd == -1) {
+        return 1;
+    }
+
+    int status = 0;
+    unsigned long lines = 0, n_words = 0, bytes = 0;
+    bool in_word = false;
+    char *buffer = malloc(FILTER_BUFFER_SIZE);
+    assert(buffer != NULL);
+    ssize_t n;
+    while ((n = read(fd, buffer, FILTER_BUFFER_SIZE)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "wc: %s: %s\n", filter.file ? filter.file : "-",
+                    strerror(errno));
+            status = 1;
+            break;
+        }
+        bytes += n;
+        if (filter.lines) {
+            lines += count_byte(buffer, n, '\n');
+        }
+        if (filter.words) {
+            for (ssize_t i = 0; i < n; i++) {
+                bool space = isspace((unsigned char)buffer[i]);
+                n_words += !space && !in_word;
+                in_word = !space;
+            }
+        }
+    }
+    free(buffer);
+
+    // one count is printed as it is; more line up in columns as wide as
+    // the file's size, or 7 when that isn't known
+    unsigned long counts[3] = {lines, n_words, bytes};
+    bool shown[3] = {filter.lines, filter.words, filter.bytes};
+    int width = 1;
+    if (shown[0] + shown[1] + shown[2] > 1) {
+        struct stat s;
+        width = 7;
+        if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
+            width = snprintf(NULL, 0, "%lld", (long long)s.st_size);
+        }
+    }
+    if (fd != in) {
+        close(fd);
+    }
+    char line[128];
+    int length = 0;
+    for (int i = 0; i < 3; i++) {
+        if (shown[i]) {
+            length += snprintf(line + length, sizeof line - length, "%*s%*lu",
+                               length > 0, "", width, counts[i]);
+        }
+    }
+    if (filter.file != NULL) {
+        dprintf(out, "%s %s\n", line, filter.file);
+    } else {
+        dprintf(out, "%s\n", line);
+    }
+    return status;
+}
+
+//
+// Implement the `head' utility, with the `filters' option on.
+//
+// Synopsis:
+//     head [-n LINES | -LINES] [FILE]
+//
+// Copies the first LINES (10 by default) lines of FILE or standard input,
+// then stops reading.
+//
+static int utility_head(char **words, int in, int out) {
+    struct filter_options filter;
+    lines_options(words, &filter);
+    int fd = filter_open("head", &filter, in);
+    if (fd == -1) {
+        return 1;
+    }
+
+    int status = 0;
+    long left = filter.count;
+    char *buffer = malloc(FILTER_BUFFER_SIZE);
+    assert(buffer != NULL);
+    while (left > 0) {
+        ssize_t n = read(fd, buffer, FILTER_BUFFER_SIZE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "head: %s: %s\n", filter.file ? filter.file : "-",
+                    strerror(errno));
+            status = 1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        char *p = buffer;
+        char *newline;
+        while (left > 0 && (newline = memchr(p, '\n', buffer + n - p))) {
+            p = newline + 1;
+            left--;
+        }
+        size_t length = left == 0 ? (size_t)(p - buffer) : (size_t)n;
+        if (!write_all(out, buffer, length)) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "head: write error: %s\n", strerror(errno));
+            }
+            status = 1;
+            break;
+        }
+    }
+    free(buffer);
+    if (fd != in) {
+        close(fd);
+    }
+    return status;
+}
+
+//
+// Implement the `tail' utility, with the `filters' option on.
+//
+// Synopsis:
+//     tail [-n LINES | -LINES] [FILE]
+//
+// Copies the last LINES (10 by default) lines of FILE or standard input.
+// A regular file is read backwards from its end, so only those lines are
+// read; anything else is read through, keeping no more than it needs.
+//
+static int utility_tail(char **words, int in, int out) {
+    struct filter_options filter;
+    lines_options(words, &filter);
+    int fd = filter_open("tail", &filter, in);
+    if (fd == -1) {
+        return 1;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
+        int status = tail_file(fd, s.st_size, filter.count, out);
+        if (fd != in) {
+            close(fd);
+        }
+        return status;
+    }
+
+    int status = 0;
+    size_t size = 2 * FILTER_BUFFER_SIZE;
+    size_t length = 0;
+    char *data = malloc(size);
+    assert(data != NULL);
+    while (1) {
+        if (size - length < FILTER_BUFFER_SIZE) {
+            // drop the lines that can't be among the last, or make room
+            size_t start = tail_start(data, length, filter.count);
+            memmove(data, data + start, length - start);
+            length -= start;
+            if (size - length < FILTER_BUFFER_SIZE) {
+                size *= 2;
+                data = realloc(data, size);
+                assert(data != NULL);
+            }
+        }
+        ssize_t n = read(fd, data + length, size - length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "tail: %s: %s\n", filter.file ? filter.file : "-",
+                    strerror(errno));
+            status = 1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+    size_t start = tail_start(data, length, filter.count);
+    if (!write_all(out, data + start, length - start)) {
+        if (errno != EPIPE) {
+            fprintf(stderr, "tail: write error: %s\n", strerror(errno));
+        }
+        status = 1;
+    }
+    free(data);
+    if (fd != in) {
+        close(fd);
+    }
+    return status;
+}
+
+// Copies the last lines lines of the size byte regular file fd to out,
+// looking for their start from the end of the file
+static int tail_file(int fd, off_t size, long lines, int out) {
+    char *buffer = malloc(FILTER_BUFFER_SIZE);
+    assert(buffer != NULL);
+    off_t start = lines == 0 ? size : 0;
+    long left = lines;
+    for (off_t at = size; at > 0 && left > 0;) {
+        size_t n = at < FILTER_BUFFER_SIZE ? at : FILTER_BUFFER_SIZE;
+        at -= n;
+        if (pread(fd, buffer, n, at) != (ssize_t)n) {
+            break;
+        }
+        size_t end = n;
+        if (at + (off_t)n == size && buffer[end - 1] == '\n') {
+            // the last line's own newline
+            end--;
+        }
+        char *newline;
+        while (left > 0 && (newline = memrchr(buffer, '\n', end)) != NULL) {
+            end = newline - buffer;
+            if (--left == 0) {
+                start = at + end + 1;
+            }
+        }
+    }
+
+    int status = 0;
+    while (start < size) {
+        ssize_t n = pread(fd, buffer, FILTER_BUFFER_SIZE, start);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (!write_all(out, buffer, n)) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "tail: write error: %s\n", strerror(errno));
+            }
+            status = 1;
+            break;
+        }
+        start += n;
+    }
+    free(buffer);
+    return status;
+}
+
+// Returns where the last lines lines of the length bytes at data start
+static size_t tail_start(const char *data, size_t length, long lines) {
+    if (lines == 0) {
+        return length;
+    }
+    size_t end = length;
+    if (end > 0 && data[end - 1] == '\n') {
+        // the last line's own newline
+        end--;
+    }
+    for (long i = 0; i < lines; i++) {
+        const char *newline = memrchr(data, '\n', end);
+        if (newline == NULL) {
+            // there aren't that many
+            return 0;
+        }
+        end = newline - data;
+    }
+    return end + 1;
+}
+
+//
+// Implement the `grep' utility, for fixed strings, with the `filters'
+// option on.
+//
+// Synopsis:
+//     grep [-Fvcq] PATTERN [FILE]
+//
+// Prints the lines of FILE or standard input that have PATTERN in them,
+// or with -v the lines that don't; -c prints how many there are instead,
+// and -q prints nothing and stops at the first.  Exits with 0 if there
+// were any, 1 if not, and 2 on error.  Whole buffers of lines are
+// searched at once, so lines that don't match are skipped over by
+// memmem(3) without being looked at one by one.
+//
+static int utility_grep(char **words, int in, int out) {
+    struct filter_options filter;
+    grep_options(words, &filter);
+    int fd = filter_open("grep", &filter, in);
+    if (fd == -1) {
+        return 2;
+    }
+
+    int status = -1;
+    unsigned long matches = 0;
+    struct buffer output = {.data = NULL};
+    size_t size = FILTER_BUFFER_SIZE;
+    size_t length = 0;
+    // with room for a newline after a last line that has none
+    char *data = malloc(size + 1);
+    assert(data != NULL);
+    bool end = false;
+    while (!end) {
+        if (length == size) {
+            // a line longer than the buffer
+            size *= 2;
+            data = realloc(data, size + 1);
+            assert(data != NULL);
+        }
+        ssize_t n = read(fd, data + length, size - length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            fprintf(stderr, "grep: %s: %s\n",
+                    filter.file ? filter.file : "(standard input)",
+                    strerror(errno));
+            status = 2;
+            break;
+        }
+        if (n == 0) {
+            end = true;
+            if (length > 0) {
+                data[length++] = '\n';
+            }
+        }
+        length += n;
+
+        // search every whole line read so far
+        char *last = memrchr(data, '\n', length);
+        if (last == NULL) {
+            continue;
+        }
+        size_t lines_length = last + 1 - data;
+        if (grep_lines(&filter, data, lines_length, &output, &matches)) {
+            // -q has found one
+            break;
+        }
+        memmove(data, data + lines_length, length - lines_length);
+        length -= lines_length;
+
+        if (output.length >= FILTER_BUFFER_SIZE) {
+            if (!write_all(out, output.data, output.length)) {
+                if (errno != EPIPE) {
+                    fprintf(stderr, "grep: write error: %s\n",
+                            strerror(errno));
+                }
+                status = 2;
+                break;
+            }
+            output.length = 0;
+        }
+    }
+    if (status == -1 && output.length > 0 &&
+        !write_all(out, output.data, output.length)) {
+        if (errno != EPIPE) {
+            fprintf(stderr, "grep: write error: %s\n", strerror(errno));
+        }
+        status = 2;
+    }
+    free(data);
+    free(output.data);
+    if (fd != in) {
+        close(fd);
+    }
+
+    if (status == -1 && filter.counts && !filter.quiet) {
+        dprintf(out, "%lu\n", matches);
+    }
+    if (status == -1) {
+        status = matches > 0 ? 0 : 1;
+    }
+    return status;
+}
+
+// Adds the lines grep selects from the length bytes at data, which end
+// with a newline, to output, or counts them.  Returns true once -q has
+// found one.
+static bool grep_lines(struct filter_options *filter, char *data,
+                       size_t length, struct buffer *output,
+                       unsigned long *matches) {
+    size_t pattern_length = strlen(filter->pattern);
+    char *p = data;
+    char *end = data + length;
+    while (p < end) {
+        char *line, *next;
+        if (!filter->invert) {
+            // jump straight to the next line with the pattern in it
+            char *found = memmem(p, end - p, filter->pattern, pattern_length);
+            if (found == NULL) {
+                break;
+            }
+            line = memrchr(p, '\n', found - p);
+            line = line != NULL ? line + 1 : p;
+            next = (char *)memchr(found, '\n', end - found) + 1;
+        } else {
+            line = p;
+            next = (char *)memchr(p, '\n', end - p) + 1;
+            if (memmem(line, next - 1 - line, filter->pattern,
+                       pattern_length) != NULL) {
+                p = next;
+                continue;
+            }
+        }
+        (*matches)++;
+        if (filter->quiet) {
+            return true;
+        }
+        if (!filter->counts) {
+            buffer_add(output, line, next - line);
+        }
+        p = next;
+    }
+    return false;
+}
+
+// whether program is one of the builtin commands that can't run in the
+// background
+static bool is_builtin(char *program) {
+    static const char *const builtins[] = {
+        "pwd",  "cd",   "history", "hash",   "set",
+        "!",    "jobs", "wait",    "fg",     "zygote",
+        "admit",
+    };
+    for (size_t i = 0; i < sizeof builtins / sizeof *builtins; i++) {
+        if (strcmp(program, builtins[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether program is one of the builtin commands that only prints
+// something, so can be part of a pipeline
+static bool is_printing_builtin(char *program) {
+    static const char *const builtins[] = {
+        "pwd", "history", "hash", "set", "jobs", "zygote", "admit",
+    };
+    for (size_t i = 0; i < sizeof builtins / sizeof *builtins; i++) {
+        if (strcmp(program, builtins[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sets up the event loop: blocks SIGCHLD, so it is only seen through the
+// signalfd, makes every program start with nothing blocked, and makes the
+// eventfd finished threads write to
+static void events_init(void) {
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&spawn_attributes);
+    posix_spawnattr_setsigmask(&spawn_attributes, &none);
+    posix_spawnattr_setflags(&spawn_attributes, POSIX_SPAWN_SETSIGMASK);
+
+    events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (events.epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    events.signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (events.signal_fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+    struct epoll_event event = {.events = EPOLLIN,
+                                .data.u64 = EVENT_SIGCHLD};
+    if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, events.signal_fd, &event) ==
+        -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    events.thread_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (events.thread_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    event.data.u64 = EVENT_THREAD;
+    if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, events.thread_fd, &event) ==
+        -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+//
+// Wait up to `timeout' milliseconds (-1 for ever) for something to happen,
+// reaping any children in the job table that exit meanwhile.
+//
+// If `fd' isn't -1, also waits for it to become readable, and returns true
+// once it is.  An fd epoll can't watch, such as a regular file, is always
+// readable.  Otherwise returns false as soon as any child has been reaped,
+// or the time is up.
+//
+static bool event_wait(int fd, long timeout) {
+    if (fd != -1) {
+        // arm the input for one event, so it can't wake up waits that
+        // aren't interested in it
+        struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                                    .data.u64 = EVENT_INPUT};
+        int op = fd == events.input_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(events.epoll_fd, op, fd, &event) == -1) {
+            return true;
+        }
+        events.input_fd = fd;
+    }
+
+    struct epoll_event ready[EVENT_BATCH];
+    int n = epoll_wait(events.epoll_fd, ready, EVENT_BATCH, timeout);
+    if (n == -1 && errno != EINTR) {
+        perror("epoll_wait");
+    }
+    bool input = false;
+    for (int i = 0; i < n; i++) {
+        uint64_t data = ready[i].data.u64;
+        if (data == EVENT_INPUT) {
+            input = true;
+        } else if (data == EVENT_ZYGOTE) {
+            zygote_read();
+        } else if (data == EVENT_THREAD) {
+            // join whichever pipeline stages have finished
+            uint64_t count;
+            read(events.thread_fd, &count, sizeof count);
+            for (int j = 0; j < jobs.count; j++) {
+                struct job *job = jobs.list[j];
+                for (int k = job->reported; k < job->count; k++) {
+                    struct stage_thread *thread = job->threads[k];
+                    if (thread != NULL && atomic_load(&thread->done)) {
+                        pthread_join(thread->thread, NULL);
+                        job->statuses[k] = W_EXITCODE(thread->status, 0);
+                        job->reaped[k] = true;
+                        job->running--;
+                        job->pidfds[k] = -1;
+                        job->threads[k] = NULL;
+                        stage_free(thread);
+                    }
+                }
+            }
+        } else if (data == EVENT_SIGCHLD) {
+            // drain the signalfd, then look for children with no pidfd
+            struct signalfd_siginfo info;
+            while (read(events.signal_fd, &info, sizeof info) > 0) {
+            }
+            if (events.unwatched > 0) {
+                for (int j = 0; j < jobs.count; j++) {
+                    struct job *job = jobs.list[j];
+                    for (int k = job->reported; k < job->count; k++) {
+                        if (job->pidfds[k] == -1) {
+                            job_reap(job, k);
+                        }
+                    }
+                }
+            }
+        } else {
+            // a pidfd: the job's number and the child's index in it
+            int id = data >> 32;
+            for (int j = 0; j < jobs.count; j++) {
+                if (jobs.list[j]->id == id) {
+                    job_reap(jobs.list[j], data & UINT32_MAX);
+                    break;
+                }
+            }
+        }
+    }
+    return input;
+}
+
+// Collects the wait status of job's i'th child if it has exited, without
+// blocking
+static void job_reap(struct job *job, int i) {
+    if (job->reaped[i] ||
+        waitpid(job->pids[i], &job->statuses[i], WNOHANG) <= 0) {
+        return;
+    }
+    job->reaped[i] = true;
+    job->running--;
+    if (job->pidfds[i] == -1) {
+        events.unwatched--;
+    } else {
+        // closing it takes it out of the epoll set as well
+        close(job->pidfds[i]);
+        job->pidfds[i] = -1;
+    }
+}
+
+// Adds a job for the command in words to the job table, numbered one more
+// than the highest numbered job already there
+static struct job *job_new(char **words, bool background) {
+    struct job *job = calloc(1, sizeof *job);
+    assert(job != NULL);
+    job->background = background;
+
+    // join the words with single spaces
+    size_t length = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        length += strlen(words[i]) + 1;
+    }
+    job->command = malloc(length);
+    assert(job->command != NULL);
+    char *end = job->command;
+    *end = '\0';
+    for (int i = 0; words[i] != NULL; i++) {
+        if (i > 0) {
+            *end++ = ' ';
+        }
+        end = stpcpy(end, words[i]);
+    }
+
+    job->id = 1;
+    for (int i = 0; i < jobs.count; i++) {
+        if (jobs.list[i]->id >= job->id) {
+            job->id = jobs.list[i]->id + 1;
+        }
+    }
+    if (jobs.count == jobs.capacity) {
+        jobs.capacity = jobs.capacity ? 2 * jobs.capacity : 8;
+        jobs.list = realloc(jobs.list, jobs.capacity * sizeof *jobs.list);
+        assert(jobs.list != NULL);
+    }
+    jobs.list[jobs.count++] = job;
+    return job;
+}
+
+// Records that pid, running program, is part of job, and watches pidfd
+// (opening one if it is -1) for it.  program is NULL if its exit status
+// shouldn't be reported.  A stage on a thread is added with PIDFD_THREAD,
+// and the caller sets its thread.
+static void job_add(struct job *job, pid_t pid, int pidfd, char *program) {
+    if (job->count == job->capacity) {
+        job->capacity = job->capacity ? 2 * job->capacity : 4;
+        job->pids = realloc(job->pids, job->capacity * sizeof *job->pids);
+        job->pidfds = realloc(job->pidfds, job->capacity * sizeof *job->pidfds);
+        job->programs =
+            realloc(job->programs, job->capacity * sizeof *job->programs);
+        job->statuses =
+            realloc(job->statuses, job->capacity * sizeof *job->statuses);
+        job->reaped = realloc(job->reaped, job->capacity * sizeof *job->reaped);
+        job->threads =
+            realloc(job->threads, job->capacity * sizeof *job->threads);
+        assert(job->pids != NULL && job->pidfds != NULL &&
+               job->programs != NULL && job->statuses != NULL &&
+               job->reaped != NULL && job->threads != NULL);
+    }
+    int i = job->count++;
+    job->pids[i] = pid;
+    job->programs[i] = program ? strdup(program) : NULL;
+    job->reaped[i] = false;
+    job->threads[i] = NULL;
+    job->running++;
+
+    // without a pidfd (an old kernel, or out of file descriptors), the
+    // SIGCHLD signalfd notices when it exits instead
+    if (pidfd == PIDFD_ZYGOTE || pidfd == PIDFD_THREAD) {
+        // the zygote says when it exits, or the thread does
+        job->pidfds[i] = pidfd;
+        return;
+    }
+    job->pidfds[i] = pidfd != -1 ? pidfd : pidfd_open(pid, 0);
+    struct epoll_event event = {.events = EPOLLIN,
+                                .data.u64 = (uint64_t)job->id << 32 | i};
+    if (job->pidfds[i] != -1 &&
+        epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, job->pidfds[i], &event) ==
+            -1) {
+        close(job->pidfds[i]);
+        job->pidfds[i] = -1;
+    }
+    if (job->pidfds[i] == -1) {
+        events.unwatched++;
+        // it may have exited before SIGCHLD was looked for
+        job_reap(job, i);
+    }
+}
+
+// Waits until no more than running of job's programs are still running,
+// reporting exit statuses as they come in, or until deadline has passed.
+// A NULL deadline waits for as long as it takes.
+static void job_wait(struct job *job, int running, struct timespec *deadline) {
+    while (1) {
+        job_report(job);
+        if (job->running <= running) {
+            break;
+        }
+        long timeout = event_timeout(deadline);
+        if (timeout == 0) {
+            break;
+        }
+        event_wait(-1, timeout);
+    }
+}
+
+// The milliseconds left until deadline, rounded up, or -1 if deadline is NULL
+static long event_timeout(struct timespec *deadline) {
+    if (deadline == NULL) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left = (deadline->tv_sec - now.tv_sec) * 1000 +
+                (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return left > 0 ? left : 0;
+}
+
+// Prints the exit status of each of job's programs that has been reaped
+// since the last call, in the order they were started.  Background jobs'
+// are prefixed with the job number.
+static void job_report(struct job *job) {
+    for (; job->reported < job->count && job->reaped[job->reported];
+         job->reported++) {
+        int i = job->reported;
+        if (job->programs[i] == NULL || !WIFEXITED(job->statuses[i])) {
+            continue;
+        }
+        if (job->background) {
+            printf("[%d] ", job->id);
+        }
+        printf("%s exit status = %d\n", job->programs[i],
+               WEXITSTATUS(job->statuses[i]));
+    }
+}
+
+// Called once every program in job has started: waits for a foreground
+// job, or announces a background one
+static void job_finish(struct job *job) {
+    if (job->count == 0) {
+        // nothing started
+        job_remove(job);
+    } else if (job->background) {
+        // a stage on a thread is part of msh itself
+        pid_t pid = job->pids[job->count - 1];
+        printf("[%d] %d\n", job->id, pid != 0 ? pid : getpid());
+        last_status = 0;
+    } else {
+        job_wait(job, 0, NULL);
+        last_status = exit_code(job->statuses[job->count - 1]);
+        job_remove(job);
+    }
+}
+
+// Takes job out of the job table and frees it
+static void job_remove(struct job *job) {
+    for (int i = 0; i < jobs.count; i++) {
+        if (jobs.list[i] == job) {
+            memmove(jobs.list + i, jobs.list + i + 1,
+                    (jobs.count - i - 1) * sizeof *jobs.list);
+            jobs.count--;
+            break;
+        }
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        free(job->programs[i]);
+    }
+    free(job->pids);
+    free(job->pidfds);
+    free(job->programs);
+    free(job->statuses);
+    free(job->reaped);
+    free(job->threads);
+    free(job->command);
+    free(job);
+}
+
+// Returns the job called name ("N" or "%N"), or the most recent job if name
+// is NULL, or prints an error for builtin and returns NULL
+static struct job *job_find(char *name, char *builtin) {
+    if (name == NULL) {
+        if (jobs.count == 0) {
+            fprintf(stderr, "%s: no current job\n", builtin);
+            return NULL;
+        }
+        return jobs.list[jobs.count - 1];
+    }
+    char *digits = name[0] == '%' ? name + 1 : name;
+    char *end;
+    long id = strtol(digits, &end, 10);
+    for (int i = 0; *digits != '\0' && *end == '\0' && i < jobs.count; i++) {
+        if (jobs.list[i]->id == id) {
+            return jobs.list[i];
+        }
+    }
+    fprintf(stderr, "%s: %s: no such job\n", builtin, name);
+    return NULL;
+}
+
+// Reports, and forgets, every background job that has finished
+static void jobs_notify(void) {
+    for (int i = 0; i < jobs.count;) {
+        struct job *job = jobs.list[i];
+        if (job->running > 0) {
+            i++;
+            continue;
+        }
+        job_report(job);
+        job_remove(job);
+    }
+}
+
+//
+// Implement the `jobs' shell built-in, which lists the background jobs.
+//
+// Synopsis:
+//     jobs
+//
+// Examples:
+//     msh> sleep 10 &
+//     [1] 4242
+//     msh> jobs
+//     [1] running  sleep 10
+//
+static int jobs_command(char **words, FILE *out) {
+    if (words[1] != NULL) {
+        fprintf(stderr, "jobs: too many arguments\n");
+        return 1;
+    }
+    // pick up anything that has exited without waiting
+    event_wait(-1, 0);
+    for (int i = 0; i < jobs.count; i++) {
+        struct job *job = jobs.list[i];
+        fprintf(out, "[%d] %-8s %s\n", job->id,
+                job->running ? "running" : "done", job->command);
+    }
+    jobs_notify();
+    return 0;
+}
+
+//
+// Implement the `wait' shell built-in, which waits for background jobs to
+// finish and reports their exit statuses.
+//
+// Synopsis:
+//     wait [-n] [-t SECONDS] [JOB...]
+//
+// With no JOB, waits for every background job.  With `-n', returns as
+// soon as any one of them has finished.  With `-t', gives up after
+// SECONDS (which may have a fraction), leaving the rest running.
+//
+// Examples:
+//     msh> sleep 1 &
+//     [1] 4242
+//     msh> sleep 5 &
+//     [2] 4243
+//     msh> wait -n
+//     [1] /bin/sleep exit status = 0
+//     msh> wait -t 0.5 %2
+//     wait: timed out
+//
+static int wait_command(char **words) {
+    bool any = false;
+    struct timespec deadline;
+    struct timespec *until = NULL;
+    int i = 1;
+    for (; words[i] != NULL && words[i][0] == '-'; i++) {
+        if (strcmp(words[i], "-n") == 0) {
+            any = true;
+        } else if (strcmp(words[i], "-t") == 0 && words[i + 1] != NULL) {
+            char *end;
+            double seconds = strtod(words[++i], &end);
+            if (*end != '\0' || end == words[i] || !(seconds >= 0) ||
+                seconds > TIMEOUT_MAX_SECONDS) {
+                fprintf(stderr, "wait: %s: invalid timeout\n", words[i]);
+                return 1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            long nanoseconds = deadline.tv_nsec + (seconds - (long)seconds) *
+                                                      1000000000;
+            deadline.tv_sec += (long)seconds + nanoseconds / 1000000000;
+            deadline.tv_nsec = nanoseconds % 1000000000;
+            until = &deadline;
+        } else {
+            fprintf(stderr, "usage: wait [-n] [-t SECONDS] [JOB...]\n");
+            return 1;
+        }
+    }
+
+    // the jobs to wait for
+    int count = 0;
+    struct job **waiting =
+        arena_alloc(&command_arena, (jobs.count + 1) * sizeof *waiting);
+    if (words[i] == NULL) {
+        for (int j = 0; j < jobs.count; j++) {
+            waiting[count++] = jobs.list[j];
+        }
+    }
+    for (; words[i] != NULL; i++) {
+        struct job *job = job_find(words[i], "wait");
+        if (job == NULL) {
+            return 1;
+        }
+        waiting[count++] = job;
+    }
+
+    int status = 0;
+    while (count > 0) {
+        // report and forget whichever have finished
+        int left = 0;
+        for (int j = 0; j < count; j++) {
+            job_report(waiting[j]);
+            if (waiting[j]->running > 0) {
+                waiting[left++] = waiting[j];
+            } else {
+                status = exit_code(waiting[j]->statuses[waiting[j]->count - 1]);
+                job_remove(waiting[j]);
+            }
+        }
+        if (left == 0 || (any && left < count)) {
+            return status;
+        }
+        count = left;
+
+        long timeout = event_timeout(until);
+        if (timeout == 0) {
+            fprintf(stderr, "wait: timed out\n");
+            return 1;
+        }
+        event_wait(-1, timeout);
+    }
+    return status;
+}
+
+//
+// Implement the `fg' shell built-in, which brings a background job to the
+// foreground: msh waits for it as if it had been run without `&'.
+//
+// Synopsis:
+//     fg [JOB]
+//
+// With no JOB, the most recent job is used.
+//
+// Examples:
+//     msh> sleep 5 &
+//     [1] 4242
+//     msh> fg
+//     sleep 5
+//     /bin/sleep exit status = 0
+//
+static int fg_command(char **words) {
+    if (words[1] != NULL && words[2] != NULL) {
+        fprintf(stderr, "fg: too many arguments\n");
+        return 1;
+    }
+    struct job *job = job_find(words[1], "fg");
+    if (job == NULL) {
+        return 1;
+    }
+    printf("%s\n", job->command);
+    job->background = false;
+    job_wait(job, 0, NULL);
+    int status = exit_code(job->statuses[job->count - 1]);
+    job_remove(job);
+    return status;
+}
+
+//
+// Run every line read from standard input as a command of its own, up to
+// `max_jobs' at once, then print how many failed and why.  This is what
+// `msh -j' does instead of the usual read-execute loop.
+//
+// Returns 0 if every command exited with status 0, and 1 otherwise.
+//
+// Examples:
+//     % printf '%s\n' 'sleep 2' 'echo hi' false | msh -j 4
+//     hi
+//     msh: 3 commands, 1 failed
+//     msh: line 3: exit status 1: false
+//
+static int batch_run(long max_jobs, char **environment) {
+    // the copies leave the history to us, and it is written in one go
+    // once every command has been read
+    long environment_count = 0;
+    while (environment[environment_count] != NULL) {
+        environment_count++;
+    }
+    char **copy_environment =
+        malloc((environment_count + 2) * sizeof *copy_environment);
+    assert(copy_environment != NULL);
+    copy_environment[0] = "MSH_HISTORY=off";
+    memcpy(copy_environment + 1, environment,
+           (environment_count + 1) * sizeof *environment);
+    options[OPTION_HISTFLUSH].value = 0;
+
+    long number = 0;
+    bool more = true;
+    while (more || batch.count > 0) {
+        while (more && batch.running < max_jobs &&
+               admit(batch.running, max_jobs)) {
+            char *line = read_line(STDIN_FILENO);
+            if (line == NULL) {
+                more = false;
+                break;
+            }
+            batch_start(line, ++number, copy_environment);
+        }
+        if (batch.count > 0) {
+            // a command that had to wait asks again in a while
+            bool deferred = more && batch.running < max_jobs;
+            batch_poll(deferred ? ADMIT_RECHECK_MS : -1);
+        }
+    }
+    history_flush();
+    free(copy_environment);
+
+    if (batch.progress) {
+        fputc('\n', stderr);
+    }
+    fprintf(stderr, "msh: %ld command%s, %ld failed\n", batch.finished,
+            batch.finished == 1 ? "" : "s", batch.failed);
+    fwrite(batch.failures.data, 1, batch.failures.length, stderr);
+    free(batch.failures.data);
+    free(batch.queue);
+    return batch.failed > 0;
+}
+
+// Starts a copy of msh running line, the number'th line of the input, with
+// pipes for its output, and adds it to the end of the queue.  Blank lines
+// are skipped.
+static void batch_start(char *line, long number, char **environment) {
+    // tokenize cuts up line, and the copy needs it whole
+    char *command = arena_strdup(&command_arena, line);
+    bool *needs_glob;
+    char **words = tokenize(&command_arena, line, (char *)WORD_SEPARATORS,
+                            (char *)SPECIAL_CHARS, &needs_glob);
+    if (words[0] == NULL) {
+        arena_reset(&command_arena);
+        return;
+    }
+    store_command(words);
+
+    struct batch_job *job = calloc(1, sizeof *job);
+    assert(job != NULL);
+    job->job = job_new(words, false);
+    job->line = number;
+    job->fds[0] = job->fds[1] = -1;
+
+    int out[2] = {-1, -1}, err[2] = {-1, -1};
+    int error = 0;
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        error = errno;
+        // only the first pipe can have been made
+        if (out[0] != -1) {
+            close(out[0]);
+            close(out[1]);
+        }
+    } else {
+        struct spawn_actions actions = {.count = 0};
+        spawn_add_open(&actions, STDIN_FILENO, "/dev/null", O_RDONLY);
+        spawn_add_dup2(&actions, out[1], STDOUT_FILENO);
+        spawn_add_dup2(&actions, err[1], STDERR_FILENO);
+        char *arguments[] = {"msh", "-c", command, NULL};
+        pid_t pid;
+        int pidfd;
+        error = spawn(&pid, &pidfd, "/proc/self/exe", &actions, arguments,
+                      environment);
+        if (error == 0) {
+            job_add(job->job, pid, pidfd, NULL);
+            job->fds[0] = out[0];
+            job->fds[1] = err[0];
+        } else {
+            close(out[0]);
+            close(err[0]);
+        }
+        close(out[1]);
+        close(err[1]);
+    }
+    if (error != 0) {
+        // it counts as a command that couldn't be found
+        char *message;
+        int length = asprintf(&message, "msh: %s\n", strerror(error));
+        assert(length != -1);
+        buffer_add(&job->output[1], message, length);
+        free(message);
+    }
+    arena_reset(&command_arena);
+
+    if (batch.count == batch.capacity) {
+        batch.capacity = batch.capacity ? 2 * batch.capacity : 16;
+        batch.queue =
+            realloc(batch.queue, batch.capacity * sizeof *batch.queue);
+        assert(batch.queue != NULL);
+    }
+    batch.queue[batch.count++] = job;
+    batch.running++;
+    batch.started++;
+    batch_progress();
+    batch_check(job);
+    batch_output();
+}
+
+// Waits up to timeout milliseconds (-1 for ever) for output from any
+// command, or for one to exit, and writes out the output of those that
+// have finished
+static void batch_poll(long timeout) {
+    // the epoll instance is readable when a child has exited
+    struct pollfd fds[1 + 2 * BATCH_MAX_JOBS];
+    struct batch_job *owners[1 + 2 * BATCH_MAX_JOBS];
+    int which[1 + 2 * BATCH_MAX_JOBS];
+    fds[0] = (struct pollfd){.fd = events.epoll_fd, .events = POLLIN};
+    int n = 1;
+    for (int i = 0; i < batch.count; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (batch.queue[i]->fds[j] != -1) {
+                fds[n] = (struct pollfd){.fd = batch.queue[i]->fds[j],
+                                         .events = POLLIN};
+                owners[n] = batch.queue[i];
+                which[n++] = j;
+            }
+        }
+    }
+    if (poll(fds, n, timeout) == -1) {
+        if (errno != EINTR) {
+            perror("poll");
+        }
+        return;
+    }
+    if (fds[0].revents != 0) {
+        event_wait(-1, 0);
+    }
+    for (int i = 1; i < n; i++) {
+        if (fds[i].revents != 0) {
+            batch_read(owners[i], which[i]);
+        }
+    }
+    for (int i = 0; i < batch.count; i++) {
+        batch_check(batch.queue[i]);
+    }
+    batch_output();
+}
+
+// Reads what job has written to its standard output (which 0) or error
+// (which 1), writing it straight out if job is the oldest one with
+// --keep-order
+static void batch_read(struct batch_job *job, int which) {
+    char data[BATCH_READ_SIZE];
+    ssize_t n = read(job->fds[which], data, sizeof data);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n <= 0) {
+        close(job->fds[which]);
+        job->fds[which] = -1;
+    } else if (batch.keep_order && job == batch.queue[0]) {
+        batch_emit(which + 1, data, n);
+    } else {
+        buffer_add(&job->output[which], data, n);
+    }
+}
+
+// Notices when job has exited and all of its output has been read, and
+// takes it out of the job table, remembering its exit status if it failed
+static void batch_check(struct batch_job *job) {
+    if (job->finished || job->fds[0] != -1 || job->fds[1] != -1 ||
+        job->job->running > 0) {
+        return;
+    }
+    int code = job->job->count > 0 ? exit_code(job->job->statuses[0]) : 127;
+    if (code != 0) {
+        char *failure;
+        int length = asprintf(&failure, "msh: line %ld: exit status %d: %s\n",
+                              job->line, code, job->job->command);
+        assert(length != -1);
+        buffer_add(&batch.failures, failure, length);
+        free(failure);
+        batch.failed++;
+    }
+    job_remove(job->job);
+    job->job = NULL;
+    job->finished = true;
+    batch.running--;
+    batch.finished++;
+    batch_progress();
+}
+
+// Writes out the output of the commands that have finished, and takes
+// them out of the queue; with --keep-order, only those that every earlier
+// command has finished before, after which the oldest one left writes
+// what it has so far
+static void batch_output(void) {
+    int kept = 0;
+    bool in_order = true;
+    for (int i = 0; i < batch.count; i++) {
+        struct batch_job *job = batch.queue[i];
+        in_order = in_order && job->finished;
+        if (job->finished && (in_order || !batch.keep_order)) {
+            batch_write(job);
+            free(job);
+        } else {
+            batch.queue[kept++] = job;
+        }
+    }
+    batch.count = kept;
+    if (batch.keep_order && batch.count > 0) {
+        batch_write(batch.queue[0]);
+    }
+}
+
+// Writes out and empties job's kept output
+static void batch_write(struct batch_job *job) {
+    for (int i = 0; i < 2; i++) {
+        if (job->output[i].length > 0) {
+            batch_emit(i + 1, job->output[i].data, job->output[i].length);
+        }
+        free(job->output[i].data);
+        job->output[i] = (struct buffer){NULL, 0, 0};
+    }
+}
+
+// Writes length bytes of data to fd, taking the --progress line out of the
+// way first
+static void batch_emit(int fd, const char *data, size_t length) {
+    if (batch.progress) {
+        fputs("\r\033[K", stderr);
+    }
+    write_all(fd, data, length);
+    batch_progress();
+}
+
+// Shows how many commands have finished, with --progress
+static void batch_progress(void) {
+    if (batch.progress) {
+        fprintf(stderr, "\rmsh: %ld/%ld done, %ld failed", batch.finished,
+                batch.started, batch.failed);
+    }
+}
+
+// The exit status a shell gives a command that ended with wait status
+// status: its exit status, or 128 plus the signal that killed it
+static int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+//
+// Decide whether one more command may start while `running' of them
+// already are, for a caller that would run up to `limit' at once.
+//
+// Returns true if it may.  Otherwise the caller should wait for one of
+// them to finish, or for `ADMIT_RECHECK_MS' to pass, and ask again.
+//
+static bool admit(long running, long limit) {
+    if (!options[OPTION_ADMIT].value) {
+        return true;
+    }
+    pthread_mutex_lock(&admission.lock);
+    admission.limit = limit;
+    if (admission.window == 0 || admission.window > limit) {
+        admission.window = limit;
+    }
+    if (!admission.opened ||
+        elapsed_ns(&admission.checked) / 1000000 >= ADMIT_RECHECK_MS) {
+        admit_check();
+    }
+    bool allowed = running == 0 || running < admission.window;
+    if (allowed) {
+        admission.admitted++;
+    } else {
+        admission.deferred++;
+    }
+    pthread_mutex_unlock(&admission.lock);
+    return allowed;
+}
+
+// Reads the pressure files and the load average again, and halves the
+// window if the machine is busy or widens it by one if it isn't.  The
+// caller holds the lock.
+static void admit_check(void) {
+    if (!admission.opened) {
+        // kept open, and read from the start each time
+        admission.opened = true;
+        for (int i = 0; i < N_ADMIT_RESOURCES; i++) {
+            admission.fds[i] = open(admit_files[i], O_RDONLY | O_CLOEXEC);
+        }
+        admission.load_fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &admission.checked);
+    admission.checks++;
+
+    static const enum option_id thresholds[N_ADMIT_RESOURCES] = {
+        OPTION_CPUPRESSURE, OPTION_MEMPRESSURE, OPTION_IOPRESSURE};
+    bool busy = false;
+    for (int i = 0; i < N_ADMIT_RESOURCES; i++) {
+        admission.pressure[i] = admit_read(admission.fds[i], "some avg10=");
+        long threshold = options[thresholds[i]].value;
+        busy = busy || (threshold > 0 && admission.pressure[i] > threshold);
+    }
+    admission.load = admit_read(admission.load_fd, NULL);
+    long load_limit = options[OPTION_LOADLIMIT].value;
+    if (load_limit == OPTION_AUTO) {
+        load_limit = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    busy = busy || (load_limit > 0 && admission.load > load_limit);
+
+    admission.busy = busy;
+    if (busy && admission.window > 1) {
+        admission.window /= 2;
+        admission.decreases++;
+    } else if (!busy && admission.window < admission.limit) {
+        admission.window++;
+        admission.increases++;
+    }
+}
+
+// Returns the number after field in the file open as fd, or the number it
+// starts with if field is NULL, or -1 if there isn't one
+static double admit_read(int fd, const char *field) {
+    char text[256];
+    ssize_t n = fd == -1 ? -1 : pread(fd, text, sizeof text - 1, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    text[n] = '\0';
+    char *start = text;
+    if (field != NULL) {
+        start = strstr(text, field);
+        if (start == NULL) {
+            return -1;
+        }
+        start += strlen(field);
+    }
+    char *end;
+    double value = strtod(start, &end);
+    return end == start ? -1 : value;
+}
+
+//
+// Implement the `admit' shell built-in, which shows what the admission
+// controller last read, and how many commands it has let start or made
+// wait.
+//
+// Synopsis:
+//     admit [-r]
+//
+// With `-r', forgets the counts.
+//
+// Examples:
+//     msh> admit
+//     admit: on, 4 of 8 at once
+//     cpu pressure       62.10%  limit 50%   busy
+//     memory pressure     0.00%  limit 10%
+//     io pressure         0.31%  limit 40%
+//     load average        3.12   limit 16
+//     checks 21, admitted 130, deferred 9, halved 2, widened 5
+//
+static int admit_command(char **words, FILE *out) {
+    bool reset = words[1] != NULL && strcmp(words[1], "-r") == 0;
+    if (words[1] != NULL && (!reset || words[2] != NULL)) {
+        fprintf(stderr, "usage: admit [-r]\n");
+        return 1;
+    }
+    pthread_mutex_lock(&admission.lock);
+    if (reset) {
+        admission.checks = admission.admitted = admission.deferred = 0;
+        admission.decreases = admission.increases = 0;
+        pthread_mutex_unlock(&admission.lock);
+        return 0;
+    }
+    if (!admission.opened) {
+        // nothing has asked yet, but the readings are still worth seeing
+        admit_check();
+    }
+
+    if (!options[OPTION_ADMIT].value) {
+        fprintf(out, "admit: off\n");
+    } else if (admission.limit == 0) {
+        fprintf(out, "admit: on\n");
+    } else {
+        fprintf(out, "admit: on, %ld of %ld at once\n", admission.window,
+                admission.limit);
+    }
+    static const char *const names[N_ADMIT_RESOURCES] = {
+        "cpu pressure", "memory pressure", "io pressure"};
+    static const enum option_id thresholds[N_ADMIT_RESOURCES] = {
+        OPTION_CPUPRESSURE, OPTION_MEMPRESSURE, OPTION_IOPRESSURE};
+    for (int i = 0; i < N_ADMIT_RESOURCES; i++) {
+        long threshold = options[thresholds[i]].value;
+        if (admission.pressure[i] < 0) {
+            fprintf(out, "%-16s %9s\n", names[i], "unavailable");
+        } else if (threshold == 0) {
+            fprintf(out, "%-16s %8.2f%%  ignored\n", names[i],
+                    admission.pressure[i]);
+        } else {
+            fprintf(out, "%-16s %8.2f%%  limit %ld%%%s\n", names[i],
+                    admission.pressure[i], threshold,
+                    admission.pressure[i] > threshold ? "   busy" : "");
+        }
+    }
+    long load_limit = options[OPTION_LOADLIMIT].value;
+    if (load_limit == OPTION_AUTO) {
+        load_limit = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (admission.load < 0) {
+        fprintf(out, "%-16s %9s\n", "load average", "unavailable");
+    } else if (load_limit == 0) {
+        fprintf(out, "%-16s %8.2f   ignored\n", "load average",
+                admission.load);
+    } else {
+        fprintf(out, "%-16s %8.2f   limit %ld%s\n", "load average",
+                admission.load, load_limit,
+                admission.load > load_limit ? "   busy" : "");
+    }
+    fprintf(out, "checks %lu, admitted %lu, deferred %lu, halved %lu, "
+                 "widened %lu\n",
+            admission.checks, admission.admitted, admission.deferred,
+            admission.decreases, admission.increases);
+    pthread_mutex_unlock(&admission.lock);
+    return 0;
+}
+//
+// Read the next line from `fd', however long it is.
+//
+// Returns the line without its newline, or `NULL' at end of input.  The
+// line is only valid until the next call.
+//
+static char *read_line(int fd) {
+    if (input.data == NULL) {
+        input.size = INPUT_BUFFER_SIZE;
+        input.data = malloc(input.size);
+        assert(input.data != NULL);
+    }
+
+    while (1) {
+        // return the next complete line if we already have one
+        char *newline = memchr(input.data + input.scanned, '\n',
+                               input.end - input.scanned);
+        if (newline != NULL) {
+            char *line = input.data + input.start;
+            *newline = '\0';
+            input.start = input.scanned = newline + 1 - input.data;
+            return line;
+        }
+        input.scanned = input.end;
+
+        // make room for more: move the partial line to the front, and
+        // grow the buffer if the line already fills it
+        if (input.start > 0) {
+            memmove(input.data, input.data + input.start,
+                    input.end - input.start);
+            input.end -= input.start;
+            input.scanned = input.end;
+            input.start = 0;
+        }
+        if (input.end + 1 >= input.size) {
+            input.size *= 2;
+            input.data = realloc(input.data, input.size);
+            assert(input.data != NULL);
+        }
+
+        // while there are jobs running, reap them as they exit instead of
+        // blocking in read(2)
+        if (jobs.count > 0 && !event_wait(fd, -1)) {
+            continue;
+        }
+
+        // keep one byte spare for the '\0' after a final unterminated line
+        ssize_t n =
+            read(fd, input.data + input.end, input.size - input.end - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("read");
+            }
+            if (input.end == input.start) {
+                return NULL;
             }
+            char *line = input.data + input.start;
+            input.data[input.end] = '\0';
+            input.start = input.scanned = input.end;
+            return line;
         }
-        // free & increment
-        posix_spawn_file_actions_destroy(&actions);
-        free_tokens(arguments);
-        current_pipe += 2;
-        program--;
-        i++;
+        input.end += n;
     }
 }
+
 //
 // Implement the `exit' shell built-in, which exits the shell.
 //
@@ -1116,6 +7113,448 @@ static void do_exit(char **words) {
     exit(exit_status);
 }
 
+//
+// Set up the shell options from the environment: `$MSH_HISTSIZE' for
+// `histsize', and so on.  Values that don't parse are ignored.
+//
+static void options_init(void) {
+    for (int i = 0; i < N_OPTIONS; i++) {
+        char name[64] = "MSH_";
+        for (int j = 0; options[i].name[j] != '\0'; j++) {
+            name[4 + j] = toupper((unsigned char)options[i].name[j]);
+        }
+        char *text = getenv(name);
+        long value;
+        if (text != NULL && parse_option_value(&options[i], text, &value)) {
+            options[i].value = value;
+        }
+    }
+}
+
+//
+// Parse `text' as a value for `option': `on', `off' (or `auto', if it
+// allows it) for a switch, or a whole number for a number, which may end
+// in `k', `m' or `g' to multiply it by 1024, 1024^2 or 1024^3.
+//
+static bool parse_option_value(struct option *option, const char *text,
+                               long *value) {
+    if (option->kind == OPTION_SWITCH) {
+        if (strcmp(text, "on") == 0) {
+            *value = 1;
+        } else if (strcmp(text, "off") == 0) {
+            *value = 0;
+        } else if (strcmp(text, "auto") == 0 && option->minimum < 0) {
+            *value = OPTION_AUTO;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if (strcmp(text, "auto") == 0 && option->minimum < 0) {
+        *value = OPTION_AUTO;
+        return true;
+    }
+    char *end;
+    errno = 0;
+    long number = strtol(text, &end, 10);
+    if (end == text || errno != 0) {
+        return false;
+    }
+    long multiplier = 1;
+    if (*end == 'k' || *end == 'K') {
+        multiplier = 1L << 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        multiplier = 1L << 20;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        multiplier = 1L << 30;
+        end++;
+    }
+    if (*end != '\0' || number < 0 || number > option->maximum / multiplier) {
+        return false;
+    }
+    number *= multiplier;
+    if (number < option->minimum) {
+        return false;
+    }
+    *value = number;
+    return true;
+}
+
+// Prints an option the way `set' takes it
+static void print_option(FILE *out, struct option *option) {
+    char value[32];
+    if (option->value == OPTION_AUTO) {
+        strcpy(value, "auto");
+    } else if (option->kind == OPTION_SWITCH) {
+        strcpy(value, option->value ? "on" : "off");
+    } else {
+        snprintf(value, sizeof value, "%ld", option->value);
+    }
+    fprintf(out, "%-12s %-10s %s\n", option->name, value, option->description);
+}
+
+//
+// Implement the `set' shell built-in, which shows or changes the shell
+// options.
+//
+// Synopsis: set [name [value]]
+// Examples:
+//     % set
+//     % set histflush 0
+//     % set globcache on
+//
+static int set_command(char **words, FILE *out) {
+    assert(strcmp(words[0], "set") == 0);
+
+    if (words[1] == NULL) {
+        for (int i = 0; i < N_OPTIONS; i++) {
+            print_option(out, &options[i]);
+        }
+        return 0;
+    }
+    if (words[2] != NULL && words[3] != NULL) {
+        fprintf(stderr, "set: too many arguments\n");
+        return 1;
+    }
+
+    struct option *option = NULL;
+    for (int i = 0; i < N_OPTIONS; i++) {
+        if (strcmp(options[i].name, words[1]) == 0) {
+            option = &options[i];
+        }
+    }
+    if (option == NULL) {
+        fprintf(stderr, "set: %s: no such option\n", words[1]);
+        return 1;
+    }
+    if (words[2] == NULL) {
+        print_option(out, option);
+        return 0;
+    }
+    long value;
+    if (!parse_option_value(option, words[2], &value)) {
+        fprintf(stderr, "set: %s: invalid value for %s\n", words[2],
+                option->name);
+        return 1;
+    }
+    option->value = value;
+    return 0;
+}
+
+// Sets the options named by the NAME=VALUE words at the start of words,
+// remembering their values for `options_restore'.  Returns how many words
+// there were, or -1 after printing an error for an invalid value.
+static int options_override(char **words) {
+    int n = 0;
+    for (; words[n] != NULL; n++) {
+        char *equals = strchr(words[n], '=');
+        struct option *option = NULL;
+        for (int i = 0; equals != NULL && i < N_OPTIONS; i++) {
+            if (strlen(options[i].name) == (size_t)(equals - words[n]) &&
+                strncmp(options[i].name, words[n], equals - words[n]) == 0) {
+                option = &options[i];
+            }
+        }
+        if (option == NULL) {
+            break;
+        }
+        if (option == &options[OPTION_HISTORY] ||
+            option == &options[OPTION_HISTSIZE]) {
+            // the history would be cut down, or not written, for good
+            fprintf(stderr, "%s: can only be changed with set\n",
+                    option->name);
+            options_restore();
+            return -1;
+        }
+        long value;
+        if (!parse_option_value(option, equals + 1, &value)) {
+            fprintf(stderr, "%s: invalid value for %s\n", equals + 1,
+                    option->name);
+            options_restore();
+            return -1;
+        }
+        bool saved = false;
+        for (int k = 0; k < option_overrides.count; k++) {
+            saved |= option_overrides.id[k] == option - options;
+        }
+        if (!saved) {
+            int k = option_overrides.count++;
+            option_overrides.id[k] = option - options;
+            option_overrides.value[k] = option->value;
+        }
+        option->value = value;
+    }
+    return n;
+}
+
+// Puts back the options `options_override' set, last first
+static void options_restore(void) {
+    while (option_overrides.count > 0) {
+        int k = --option_overrides.count;
+        options[option_overrides.id[k]].value = option_overrides.value[k];
+    }
+}
+
+//
+// Return the directories in `$PATH' (or the default path), splitting the
+// variable again and forgetting every hashed command if it has changed
+// since the last call.
+//
+static char **command_path(void) {
+    char *pathp;
+    if ((pathp = getenv("PATH")) == NULL) {
+        pathp = (char *)DEFAULT_PATH;
+    }
+    if (command_hash.path != NULL &&
+        strcmp(command_hash.path_value, pathp) == 0) {
+        return command_hash.path;
+    }
+
+    hash_clear();
+    if (command_hash.path != NULL) {
+        free(command_hash.path_value);
+        free(command_hash.mtimes);
+        arena_reset(&command_hash.path_arena);
+    }
+    command_hash.path_value = strdup(pathp);
+    assert(command_hash.path_value != NULL);
+    command_hash.path =
+        tokenize(&command_hash.path_arena, pathp, ":", "", NULL);
+
+    int n_dirs = 0;
+    while (command_hash.path[n_dirs] != NULL) {
+        n_dirs++;
+    }
+    command_hash.mtimes = calloc(n_dirs + 1, sizeof *command_hash.mtimes);
+    assert(command_hash.mtimes != NULL);
+    for (int i = 0; i < n_dirs; i++) {
+        struct stat s;
+        if (stat(command_hash.path[i], &s) == 0) {
+            command_hash.mtimes[i] = s.st_mtim;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &command_hash.checked);
+    return command_hash.path;
+}
+
+// FNV-1a hash of a command name
+static unsigned long hash_string(char *s) {
+    unsigned long h = 2166136261UL;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619UL;
+    }
+    return h;
+}
+
+// Returns the hash entry for `program', searching `path' and adding a new
+// (possibly negative) entry if it isn't in the table yet
+static struct hash_entry *hash_find(char *program, char **path) {
+    assert(path == command_hash.path);
+    hash_check_directories();
+
+    unsigned long bucket = hash_string(program) % COMMAND_HASH_BUCKETS;
+    struct hash_entry *entry = command_hash.buckets[bucket];
+    while (entry != NULL && strcmp(entry->name, program) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        return entry;
+    }
+
+    entry = calloc(1, sizeof *entry);
+    assert(entry != NULL);
+    entry->name = strdup(program);
+    assert(entry->name != NULL);
+    entry->dir = -1;
+    // loop through all the possible pathnames in $PATH
+    for (int i = 0; path[i] != NULL; i++) {
+        size_t length = strlen(path[i]) + strlen(program) + 2;
+        char *pathname = malloc(length);
+        assert(pathname != NULL);
+        snprintf(pathname, length, "%s/%s", path[i], program);
+        if (is_executable(pathname)) {
+            entry->pathname = pathname;
+            entry->dir = i;
+            break;
+        }
+        free(pathname);
+    }
+    entry->next = command_hash.buckets[bucket];
+    command_hash.buckets[bucket] = entry;
+    return entry;
+}
+
+// Returns the full pathname `program' runs from, or NULL if it is not in
+// `$PATH'.  The string belongs to the hash table.
+static char *hash_lookup(char *program, char **path) {
+    struct hash_entry *entry = hash_find(program, path);
+    if (entry->pathname != NULL) {
+        entry->hits++;
+    }
+    return entry->pathname;
+}
+
+// Returns the full pathname `program' runs from, malloc'd, or NULL if it
+// is not in `$PATH'.  Unlike `hash_lookup', which only the main thread may
+// use, it searches `$PATH' every time, so it is safe on any thread.
+static char *path_search(char *program) {
+    if (strrchr(program, '/') != NULL) {
+        return is_executable(program) ? strdup(program) : NULL;
+    }
+    char *value = getenv("PATH");
+    if (value == NULL) {
+        value = (char *)DEFAULT_PATH;
+    }
+    for (char *dir = value;; dir++) {
+        size_t dir_length = strcspn(dir, ":");
+        size_t length = dir_length + strlen(program) + 2;
+        char *pathname = malloc(length);
+        assert(pathname != NULL);
+        snprintf(pathname, length, "%.*s/%s", (int)dir_length, dir, program);
+        if (is_executable(pathname)) {
+            return pathname;
+        }
+        free(pathname);
+        dir += dir_length;
+        if (*dir == '\0') {
+            return NULL;
+        }
+    }
+}
+
+// Re-stat the `$PATH' directories if it has been long enough, dropping the
+// entries a changed directory could have made wrong
+static void hash_check_directories(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long elapsed = (now.tv_sec - command_hash.checked.tv_sec) * 1000 +
+                   (now.tv_nsec - command_hash.checked.tv_nsec) / 1000000;
+    if (elapsed < HASH_RECHECK_MS) {
+        return;
+    }
+    command_hash.checked = now;
+
+    // find the first directory that has changed
+    int changed = -1;
+    for (int i = 0; command_hash.path[i] != NULL; i++) {
+        struct stat s;
+        struct timespec mtime = {0};
+        if (stat(command_hash.path[i], &s) == 0) {
+            mtime = s.st_mtim;
+        }
+        if (mtime.tv_sec != command_hash.mtimes[i].tv_sec ||
+            mtime.tv_nsec != command_hash.mtimes[i].tv_nsec) {
+            command_hash.mtimes[i] = mtime;
+            if (changed == -1) {
+                changed = i;
+            }
+        }
+    }
+    if (changed == -1) {
+        return;
+    }
+
+    // a new file could shadow anything found in a later directory, and a
+    // removed file only affects entries found in that directory
+    for (int b = 0; b < COMMAND_HASH_BUCKETS; b++) {
+        struct hash_entry **link = &command_hash.buckets[b];
+        while (*link != NULL) {
+            struct hash_entry *entry = *link;
+            if (entry->pathname == NULL || entry->dir >= changed) {
+                *link = entry->next;
+                free(entry->name);
+                free(entry->pathname);
+                free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+// Forget every hashed command
+static void hash_clear(void) {
+    for (int b = 0; b < COMMAND_HASH_BUCKETS; b++) {
+        struct hash_entry *entry = command_hash.buckets[b];
+        while (entry != NULL) {
+            struct hash_entry *next = entry->next;
+            free(entry->name);
+            free(entry->pathname);
+            free(entry);
+            entry = next;
+        }
+        command_hash.buckets[b] = NULL;
+    }
+}
+
+//
+// Implement the `hash' shell built-in, which shows or changes the table of
+// remembered command locations.
+//
+// Synopsis: hash [-r] [-t name...] [name...]
+// Examples:
+//     % hash
+//     % hash -r
+//     % hash -t ls
+//
+static int hash_command(char **words, FILE *out) {
+    assert(strcmp(words[0], "hash") == 0);
+    char **path = command_path();
+
+    if (words[1] == NULL) {
+        // list the table with the number of times each command was run
+        int listed = 0;
+        for (int b = 0; b < COMMAND_HASH_BUCKETS; b++) {
+            for (struct hash_entry *entry = command_hash.buckets[b];
+                 entry != NULL; entry = entry->next) {
+                if (!listed) {
+                    fprintf(out, "hits\tcommand\n");
+                }
+                listed = 1;
+                if (entry->pathname != NULL) {
+                    fprintf(out, "%4lu\t%s\n", entry->hits, entry->pathname);
+                } else {
+                    fprintf(out, "%4lu\t%s: not found\n", entry->hits,
+                            entry->name);
+                }
+            }
+        }
+        if (!listed) {
+            fprintf(out, "hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(words[1], "-r") == 0) {
+        if (words[2] != NULL) {
+            fprintf(stderr, "hash: too many arguments\n");
+            return 1;
+        }
+        hash_clear();
+        return 0;
+    }
+
+    // print where each name lives with -t, otherwise just remember it
+    int print = strcmp(words[1], "-t") == 0;
+    int status = 0;
+    for (int i = print ? 2 : 1; words[i] != NULL; i++) {
+        if (strrchr(words[i], '/') != NULL) {
+            continue;
+        }
+        struct hash_entry *entry = hash_find(words[i], path);
+        if (entry->pathname == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", words[i]);
+            status = 1;
+        } else if (print) {
+            fprintf(out, "%s\n", entry->pathname);
+        }
+    }
+    return status;
+}
+
 //
 // Check whether this process can execute a file.  This function will be
 // useful while searching through the list of directories in the path to
@@ -1136,66 +7575,296 @@ static int is_executable(char *pathname) {
 // Split a string 's' into pieces by any one of a set of separators.
 //
 // Returns an array of strings, with the last element being `NULL'.
-// The array itself, and the strings, are allocated with `malloc(3)';
-// the provided `free_token' function can deallocate this.
+// The array and the strings are bumped out of `arena' and are released
+// when the arena is reset.  If `needs_glob' isn't NULL, it is pointed at
+// an array saying whether each string has any of `GLOB_CHARS' in it.
 //
-static char **tokenize(char *s, char *separators, char *special_chars) {
-    size_t n_tokens = 0;
+// The line is classified into bitmaps first, a vector of characters at a
+// time, so finding each boundary is a bit scan rather than a `strspn'.
+//
+static char **tokenize(struct arena *arena, char *s, char *separators,
+                       char *special_chars, bool **needs_glob) {
+    static classify_fn *classify = NULL;
+    if (classify == NULL) {
+        classify = classify_scalar;
+#ifdef MSH_X86_SIMD
+        __builtin_cpu_init();
+        classify = __builtin_cpu_supports("avx2") ? classify_avx2
+                                                  : classify_sse2;
+#endif
+    }
 
-    // Allocate space for tokens.  We don't know how many tokens there
-    // are yet --- pessimistically assume that every single character
-    // will turn into a token.  (We fix this later.)
-    char **tokens = calloc((strlen(s) + 1), sizeof *tokens);
-    assert(tokens != NULL);
+    size_t length = strlen(s);
+    size_t n_words = length / 64 + 1;
+    uint64_t *separator = arena_alloc(arena, 4 * n_words * sizeof *separator);
+    uint64_t *special = separator + n_words;
+    uint64_t *glob = special + n_words;
+    uint64_t *token_glob = glob + n_words;
+    memset(separator, 0, 4 * n_words * sizeof *separator);
+    classify(s, length, separators, special_chars, separator, special, glob);
 
-    while (*s != '\0') {
-        // We are pointing at zero or more of any of the separators.
+    // Every character could be a token of its own, which needs a '\0'
+    // after it, so that is the most room the copies can take.  What
+    // isn't used is handed back to the arena afterwards.
+    char *bytes = arena_alloc(arena, 2 * length + 1);
+    char *end = bytes;
+    size_t n_tokens = 0;
+
+    size_t i = 0;
+    while (i < length) {
         // Skip all leading instances of the separators.
-        s += strspn(s, separators);
+        i = bitmap_next(separator, NULL, true, i, length);
 
         // Trailing separators after the last token mean that, at this
         // point, we are looking at the end of the string, so:
-        if (*s == '\0') {
+        if (i == length) {
             break;
         }
 
-        // Now, `s' points at one or more characters we want to keep.
-        // The number of non-separator characters is the token length.
-        size_t length = strcspn(s, separators);
-        size_t length_without_specials = strcspn(s, special_chars);
-        if (length_without_specials == 0) {
-            length_without_specials = 1;
+        // A special character is a token by itself, otherwise the token
+        // runs to the next separator or special character.
+        size_t token_end = i + 1;
+        if (!bitmap_test(special, i)) {
+            token_end = bitmap_next(separator, special, false, i, length);
         }
-        if (length_without_specials < length) {
-            length = length_without_specials;
+        if (bitmap_next(glob, NULL, false, i, token_end) != token_end) {
+            token_glob[n_tokens / 64] |= 1ULL << (n_tokens % 64);
         }
 
-        // Allocate a copy of the token.
-        char *token = strndup(s, length);
-        assert(token != NULL);
-        s += length;
-
-        // Add this token.
-        tokens[n_tokens] = token;
+        // Copy the token into the arena.
+        memcpy(end, s + i, token_end - i);
+        end[token_end - i] = '\0';
+        end += token_end - i + 1;
+        i = token_end;
         n_tokens++;
     }
+    arena_shrink(arena, bytes, end - bytes);
 
-    // Add the final `NULL'.
+    // Point the array at each of the copies, and add the final `NULL'.
+    char **tokens = arena_alloc(arena, (n_tokens + 1) * sizeof *tokens);
+    char *token = bytes;
+    for (size_t j = 0; j < n_tokens; j++) {
+        tokens[j] = token;
+        token += strlen(token) + 1;
+    }
     tokens[n_tokens] = NULL;
 
-    // Finally, shrink our array back down to the correct size.
-    tokens = realloc(tokens, (n_tokens + 1) * sizeof *tokens);
-    assert(tokens != NULL);
+    if (needs_glob != NULL) {
+        *needs_glob = arena_alloc(arena, (n_tokens + 1) * sizeof **needs_glob);
+        for (size_t j = 0; j < n_tokens; j++) {
+            (*needs_glob)[j] = bitmap_test(token_glob, j);
+        }
+    }
 
     return tokens;
 }
 
+// Whether bit `i' of `bitmap' is set
+static bool bitmap_test(const uint64_t *bitmap, size_t i) {
+    return (bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+//
+// Find the first bit at or after `from' that is set in `a' or `b' (or
+// clear in `a', if `clear').  `b' may be NULL.  Returns `limit' if there
+// is none below it.
+//
+static size_t bitmap_next(const uint64_t *a, const uint64_t *b, bool clear,
+                          size_t from, size_t limit) {
+    if (from >= limit) {
+        return limit;
+    }
+    size_t word = from / 64;
+    uint64_t bits = (clear ? ~a[word] : a[word]) | (b ? b[word] : 0);
+    bits &= ~0ULL << (from % 64);
+    while (bits == 0) {
+        word++;
+        if (word * 64 >= limit) {
+            return limit;
+        }
+        bits = (clear ? ~a[word] : a[word]) | (b ? b[word] : 0);
+    }
+    size_t i = word * 64 + __builtin_ctzll(bits);
+    return i < limit ? i : limit;
+}
+
+// Classify a character at a time with a lookup table
+static void classify_scalar(const char *s, size_t length,
+                            const char *separators, const char *special_chars,
+                            uint64_t *separator, uint64_t *special,
+                            uint64_t *glob) {
+    unsigned char class[256] = {0};
+    for (const char *c = separators; *c != '\0'; c++) {
+        class[(unsigned char)*c] |= 1;
+    }
+    for (const char *c = special_chars; *c != '\0'; c++) {
+        class[(unsigned char)*c] |= 2;
+    }
+    for (const char *c = GLOB_CHARS; *c != '\0'; c++) {
+        class[(unsigned char)*c] |= 4;
+    }
+    for (size_t i = 0; i < length; i++) {
+        unsigned char bits = class[(unsigned char)s[i]];
+        uint64_t bit = 1ULL << (i % 64);
+        if (bits & 1) separator[i / 64] |= bit;
+        if (bits & 2) special[i / 64] |= bit;
+        if (bits & 4) glob[i / 64] |= bit;
+    }
+}
+
+#ifdef MSH_X86_SIMD
+//
+// Classifier sets:
+//     The most characters any one set given to the vector classifiers
+//     can have; longer sets are classified with `classify_scalar'.
+//
+#define CLASSIFY_MAX_SET 8
+
+// Classify 16 characters at a time with SSE2
+static void classify_sse2(const char *s, size_t length,
+                          const char *separators, const char *special_chars,
+                          uint64_t *separator, uint64_t *special,
+                          uint64_t *glob) {
+    const char *sets[3] = {separators, special_chars, GLOB_CHARS};
+    uint64_t *bitmaps[3] = {separator, special, glob};
+    __m128i chars[3][CLASSIFY_MAX_SET];
+    int n_chars[3];
+    for (int k = 0; k < 3; k++) {
+        n_chars[k] = strlen(sets[k]);
+        if (n_chars[k] > CLASSIFY_MAX_SET) {
+            classify_scalar(s, length, separators, special_chars, separator,
+                            special, glob);
+            return;
+        }
+        for (int c = 0; c < n_chars[k]; c++) {
+            chars[k][c] = _mm_set1_epi8(sets[k][c]);
+        }
+    }
+
+    for (size_t i = 0; i < length; i += 16) {
+        __m128i v;
+        if (length - i >= 16) {
+            v = _mm_loadu_si128((const __m128i *)(s + i));
+        } else {
+            // don't read past the end of the line
+            char tail[16] = {0};
+            memcpy(tail, s + i, length - i);
+            v = _mm_loadu_si128((const __m128i *)tail);
+        }
+        for (int k = 0; k < 3; k++) {
+            __m128i match = _mm_setzero_si128();
+            for (int c = 0; c < n_chars[k]; c++) {
+                match = _mm_or_si128(match, _mm_cmpeq_epi8(v, chars[k][c]));
+            }
+            uint64_t bits = (uint16_t)_mm_movemask_epi8(match);
+            bitmaps[k][i / 64] |= bits << (i % 64);
+        }
+    }
+}
+
+// Classify 32 characters at a time with AVX2
+__attribute__((target("avx2"))) static void
+classify_avx2(const char *s, size_t length, const char *separators,
+              const char *special_chars, uint64_t *separator,
+              uint64_t *special, uint64_t *glob) {
+    const char *sets[3] = {separators, special_chars, GLOB_CHARS};
+    uint64_t *bitmaps[3] = {separator, special, glob};
+    __m256i chars[3][CLASSIFY_MAX_SET];
+    int n_chars[3];
+    for (int k = 0; k < 3; k++) {
+        n_chars[k] = strlen(sets[k]);
+        if (n_chars[k] > CLASSIFY_MAX_SET) {
+            classify_scalar(s, length, separators, special_chars, separator,
+                            special, glob);
+            return;
+        }
+        for (int c = 0; c < n_chars[k]; c++) {
+            chars[k][c] = _mm256_set1_epi8(sets[k][c]);
+        }
+    }
+
+    for (size_t i = 0; i < length; i += 32) {
+        __m256i v;
+        if (length - i >= 32) {
+            v = _mm256_loadu_si256((const __m256i *)(s + i));
+        } else {
+            // don't read past the end of the line
+            char tail[32] = {0};
+            memcpy(tail, s + i, length - i);
+            v = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        for (int k = 0; k < 3; k++) {
+            __m256i match = _mm256_setzero_si256();
+            for (int c = 0; c < n_chars[k]; c++) {
+                match = _mm256_or_si256(match,
+                                        _mm256_cmpeq_epi8(v, chars[k][c]));
+            }
+            uint64_t bits = (uint32_t)_mm256_movemask_epi8(match);
+            bitmaps[k][i / 64] |= bits << (i % 64);
+        }
+    }
+}
+#endif
+
+//
+// Allocate `size' bytes from `arena', adding a block if none of the
+// blocks it already has can fit them.
+//
+static void *arena_alloc(struct arena *arena, size_t size) {
+    // keep every allocation aligned for any type
+    size_t align = _Alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    struct arena_block *block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof *block + block_size);
+        assert(block != NULL);
+        block->size = block_size;
+        block->used = 0;
+        // put the new block at the front so it is used first
+        block->next = arena->head;
+        arena->head = block;
+    }
+    arena->current = block;
+
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+//
+// Shrink `last', the most recent allocation from `arena', to `size' bytes.
+//
+static void arena_shrink(struct arena *arena, void *last, size_t size) {
+    struct arena_block *block = arena->current;
+    assert((char *)last >= block->data &&
+           (char *)last <= block->data + block->used);
+    size_t align = _Alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    block->used = ((char *)last - block->data) + size;
+}
+
+//
+// Copy a string into `arena'.
+//
+static char *arena_strdup(struct arena *arena, const char *s) {
+    size_t length = strlen(s) + 1;
+    char *copy = arena_alloc(arena, length);
+    memcpy(copy, s, length);
+    return copy;
+}
+
 //
-// Free an array of strings as returned by `tokenize'.
+// Release everything allocated from `arena', keeping its blocks.
 //
-static void free_tokens(char **tokens) {
-    for (int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
+static void arena_reset(struct arena *arena) {
+    for (struct arena_block *block = arena->head; block != NULL;
+         block = block->next) {
+        block->used = 0;
     }
-    free(tokens);
+    arena->current = arena->head;
 }